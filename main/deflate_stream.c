@@ -0,0 +1,368 @@
+/*
+ * UBAC:deflate_stream.c for ESP32 to compress HTTP responses on the fly.
+ * Copyright (C) 2026 Côme VINCENT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "deflate_stream.h"
+
+#include "esp_rom_crc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WINDOW      DEFLATE_STREAM_WINDOW
+#define WINDOW_MASK (WINDOW - 1)
+#define BUF_SIZE    (2 * WINDOW)
+#define MIN_MATCH   3
+#define MAX_MATCH   258
+#define LOOKAHEAD   (MAX_MATCH + MIN_MATCH + 1)
+#define MAX_DIST    (WINDOW - LOOKAHEAD)   // still in buf after a slide
+#define HASH_BITS   10
+#define HASH_SIZE   (1 << HASH_BITS)
+#define MAX_CHAIN   8                      // candidates tried per position
+#define NIL         0xFFFF
+
+struct deflate_stream
+{
+  deflate_stream_format_t format;
+  deflate_stream_out_cb_t out_cb;
+  void *ctx;
+  bool failed;
+
+  // Input: the last WINDOW bytes of history, then the data to encode
+  uint8_t buf[BUF_SIZE];
+  uint32_t pos;   // next byte to encode
+  uint32_t end;   // end of buffered input
+  uint16_t head[HASH_SIZE];   // newest position per hash, NIL if none
+  uint16_t prev[WINDOW];      // older position with the same hash
+
+  uint32_t bits;
+  uint32_t nbits;
+  uint32_t check;   // CRC-32 (gzip) or Adler-32 (zlib) of the input
+  uint32_t total_in;
+  uint32_t total_out;
+
+  size_t out_size;
+  size_t out_len;
+  uint8_t out[];
+};
+
+// Match lengths 3..258 and distances 1..32768 as base + extra bits
+static const uint16_t s_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t s_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t s_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const uint8_t s_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static bool out_flush(deflate_stream_t *z)
+{
+  if (z->out_len > 0 && !z->failed)
+    z->failed = !z->out_cb(z->out, z->out_len, z->ctx);
+  z->out_len = 0;
+  return !z->failed;
+}
+
+static void out_byte(deflate_stream_t *z, uint8_t b)
+{
+  if (z->out_len == z->out_size)
+    out_flush(z);
+  z->out[z->out_len++] = b;
+  z->total_out++;
+}
+
+// DEFLATE packs bits from the least significant end
+static void put_bits(deflate_stream_t *z, uint32_t value, uint32_t n)
+{
+  z->bits |= value << z->nbits;
+  z->nbits += n;
+  while (z->nbits >= 8)
+  {
+    out_byte(z, (uint8_t) z->bits);
+    z->bits >>= 8;
+    z->nbits -= 8;
+  }
+}
+
+static void align_byte(deflate_stream_t *z)
+{
+  if (z->nbits > 0)
+    put_bits(z, 0, 8 - z->nbits);
+}
+
+// Huffman codes are defined most significant bit first
+static uint32_t reverse(uint32_t code, uint32_t n)
+{
+  uint32_t r = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    r = (r << 1) | (code & 1);
+    code >>= 1;
+  }
+  return r;
+}
+
+// Fixed literal/length code (RFC 1951 3.2.6)
+static void put_litlen(deflate_stream_t *z, uint32_t sym)
+{
+  if (sym < 144)
+    put_bits(z, reverse(0x30 + sym, 8), 8);
+  else if (sym < 256)
+    put_bits(z, reverse(0x190 + sym - 144, 9), 9);
+  else if (sym < 280)
+    put_bits(z, reverse(sym - 256, 7), 7);
+  else
+    put_bits(z, reverse(0xC0 + sym - 280, 8), 8);
+}
+
+static void put_match(deflate_stream_t *z, uint32_t len, uint32_t dist)
+{
+  int l = 28;
+  while (s_len_base[l] > len)
+    l--;
+  put_litlen(z, 257 + l);
+  put_bits(z, len - s_len_base[l], s_len_extra[l]);
+
+  int d = 29;
+  while (s_dist_base[d] > dist)
+    d--;
+  put_bits(z, reverse(d, 5), 5);
+  put_bits(z, dist - s_dist_base[d], s_dist_extra[d]);
+}
+
+static uint32_t hash3(const uint8_t *p)
+{
+  uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void insert(deflate_stream_t *z, uint32_t p)
+{
+  uint32_t h = hash3(z->buf + p);
+  z->prev[p & WINDOW_MASK] = z->head[h];
+  z->head[h] = (uint16_t) p;
+}
+
+// Keeps the last WINDOW bytes: positions move down by WINDOW
+static void slide(deflate_stream_t *z)
+{
+  memmove(z->buf, z->buf + WINDOW, BUF_SIZE - WINDOW);
+  z->pos -= WINDOW;
+  z->end -= WINDOW;
+  for (int i = 0; i < HASH_SIZE; i++)
+    z->head[i] = (z->head[i] != NIL && z->head[i] >= WINDOW) ? z->head[i] - WINDOW : NIL;
+  for (int i = 0; i < WINDOW; i++)
+    z->prev[i] = (z->prev[i] != NIL && z->prev[i] >= WINDOW) ? z->prev[i] - WINDOW : NIL;
+}
+
+static uint32_t longest_match(deflate_stream_t *z, uint32_t *dist)
+{
+  uint32_t avail = z->end - z->pos;
+  uint32_t max = avail < MAX_MATCH ? avail : MAX_MATCH;
+  const uint8_t *cur = z->buf + z->pos;
+  uint32_t best = 0;
+
+  uint32_t cand = z->head[hash3(cur)];
+  for (int chain = 0; chain < MAX_CHAIN && cand != NIL && cand < z->pos; chain++)
+  {
+    if (z->pos - cand > MAX_DIST)
+      break;
+
+    const uint8_t *m = z->buf + cand;
+    if (m[best] == cur[best])
+    {
+      uint32_t n = 0;
+      while (n < max && m[n] == cur[n])
+        n++;
+      if (n > best)
+      {
+        best = n;
+        *dist = z->pos - cand;
+        if (n == max)
+          break;
+      }
+    }
+
+    // An older entry was overwritten by a newer one: the chain ends here
+    uint32_t next = z->prev[cand & WINDOW_MASK];
+    if (next == NIL || next >= cand)
+      break;
+    cand = next;
+  }
+  return best >= MIN_MATCH ? best : 0;
+}
+
+// Encodes while a full match can be looked ahead, or everything on finish
+static void encode(deflate_stream_t *z, bool finish)
+{
+  while (!z->failed && (z->end - z->pos >= LOOKAHEAD || (finish && z->pos < z->end)))
+  {
+    uint32_t dist = 0;
+    uint32_t len = (z->end - z->pos >= MIN_MATCH) ? longest_match(z, &dist) : 0;
+    if (len == 0)
+    {
+      if (z->end - z->pos >= MIN_MATCH)
+        insert(z, z->pos);
+      put_litlen(z, z->buf[z->pos]);
+      z->pos++;
+      continue;
+    }
+
+    put_match(z, len, dist);
+    for (uint32_t i = 0; i < len; i++, z->pos++)
+    {
+      if (z->end - z->pos >= MIN_MATCH)
+        insert(z, z->pos);
+    }
+  }
+}
+
+static uint32_t adler32(uint32_t adler, const uint8_t *p, size_t len)
+{
+  uint32_t a = adler & 0xFFFF;
+  uint32_t b = adler >> 16;
+  while (len > 0)
+  {
+    // 5552 bytes is the most that cannot overflow b before the modulo
+    size_t n = len < 5552 ? len : 5552;
+    len -= n;
+    while (n--)
+    {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+deflate_stream_t *deflate_stream_new(deflate_stream_format_t format,
+                                     size_t out_size,
+                                     deflate_stream_out_cb_t out, void *ctx)
+{
+  deflate_stream_t *z = malloc(sizeof(*z) + out_size);
+  if (!z)
+    return NULL;
+
+  z->format = format;
+  z->out_cb = out;
+  z->ctx = ctx;
+  z->failed = false;
+  z->pos = 0;
+  z->end = 0;
+  memset(z->head, 0xFF, sizeof(z->head));
+  memset(z->prev, 0xFF, sizeof(z->prev));
+  z->bits = 0;
+  z->nbits = 0;
+  z->total_in = 0;
+  z->total_out = 0;
+  z->out_size = out_size;
+  z->out_len = 0;
+
+  if (format == DEFLATE_STREAM_GZIP)
+  {
+    // No name or time; OS "unknown"
+    static const uint8_t hdr[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF};
+    for (size_t i = 0; i < sizeof(hdr); i++)
+      out_byte(z, hdr[i]);
+    z->check = 0;
+  }
+  else if (format == DEFLATE_STREAM_ZLIB)
+  {
+    // CINFO 3 (2 KiB window), fastest level, FCHECK making it a multiple of 31
+    out_byte(z, 0x38);
+    out_byte(z, 0x11);
+    z->check = 1;
+  }
+
+  // One fixed-Huffman block for the whole stream, closed by finish()
+  put_bits(z, 0, 1);
+  put_bits(z, 1, 2);
+  return z;
+}
+
+bool deflate_stream_write(deflate_stream_t *z, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *) data;
+  z->total_in += len;
+  if (z->format == DEFLATE_STREAM_GZIP)
+    z->check = esp_rom_crc32_le(z->check, p, len);
+  else if (z->format == DEFLATE_STREAM_ZLIB)
+    z->check = adler32(z->check, p, len);
+
+  while (len > 0 && !z->failed)
+  {
+    // encode() left less than LOOKAHEAD bytes, so pos >= WINDOW here
+    if (z->end == BUF_SIZE)
+      slide(z);
+
+    size_t n = BUF_SIZE - z->end;
+    if (n > len)
+      n = len;
+    memcpy(z->buf + z->end, p, n);
+    z->end += n;
+    p += n;
+    len -= n;
+    encode(z, false);
+  }
+  return !z->failed;
+}
+
+bool deflate_stream_finish(deflate_stream_t *z)
+{
+  encode(z, true);
+
+  // End of block, then an empty final block
+  put_litlen(z, 256);
+  put_bits(z, 1, 1);
+  put_bits(z, 1, 2);
+  put_litlen(z, 256);
+  align_byte(z);
+
+  if (z->format == DEFLATE_STREAM_GZIP)
+  {
+    for (int i = 0; i < 32; i += 8)
+      out_byte(z, (uint8_t) (z->check >> i));
+    for (int i = 0; i < 32; i += 8)
+      out_byte(z, (uint8_t) (z->total_in >> i));
+  }
+  else if (z->format == DEFLATE_STREAM_ZLIB)
+  {
+    for (int i = 24; i >= 0; i -= 8)
+      out_byte(z, (uint8_t) (z->check >> i));
+  }
+  return out_flush(z);
+}
+
+void deflate_stream_totals(const deflate_stream_t *z, uint32_t *in,
+                           uint32_t *out)
+{
+  *in = z->total_in;
+  *out = z->total_out;
+}
+
+void deflate_stream_free(deflate_stream_t *z)
+{
+  free(z);
+}
@@ -0,0 +1,86 @@
+/*
+ * UBAC:deflate_stream.h for ESP32 to compress HTTP responses on the fly.
+ * Copyright (C) 2026 Côme VINCENT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming DEFLATE (RFC 1951) compressor sized for the ESP32: greedy LZ77
+ * matching over a DEFLATE_STREAM_WINDOW byte window and fixed Huffman codes,
+ * so no tables are built per block. About 10 KiB of heap per stream plus the
+ * output buffer.
+ */
+#define DEFLATE_STREAM_WINDOW 2048
+
+typedef enum
+{
+  DEFLATE_STREAM_RAW,    // bare RFC 1951 data
+  DEFLATE_STREAM_ZLIB,   // RFC 1950 wrapper, HTTP "deflate"
+  DEFLATE_STREAM_GZIP,   // RFC 1952 wrapper, HTTP "gzip"
+} deflate_stream_format_t;
+
+/**
+ * @brief Sink for compressed output; return false to abort the stream.
+ */
+typedef bool (*deflate_stream_out_cb_t)(const uint8_t *data, size_t len,
+                                        void *ctx);
+
+typedef struct deflate_stream deflate_stream_t;
+
+/**
+ * @brief Allocate a compressor.
+ *
+ * @param format    Container written around the DEFLATE data
+ * @param out_size  Output is handed to out in pieces of this size (the last
+ *                  one may be shorter)
+ * @param out       Output sink
+ * @param ctx       User context passed to out
+ *
+ * @return the compressor, or NULL when out of memory
+ */
+deflate_stream_t *deflate_stream_new(deflate_stream_format_t format,
+                                     size_t out_size,
+                                     deflate_stream_out_cb_t out, void *ctx);
+
+/**
+ * @brief Compress more input.
+ *
+ * @return false once the output sink has failed
+ */
+bool deflate_stream_write(deflate_stream_t *z, const void *data, size_t len);
+
+/**
+ * @brief Compress what is left, write the trailer and flush the output.
+ *
+ * @return false once the output sink has failed
+ */
+bool deflate_stream_finish(deflate_stream_t *z);
+
+/**
+ * @brief Bytes consumed and produced so far (container included).
+ */
+void deflate_stream_totals(const deflate_stream_t *z, uint32_t *in,
+                           uint32_t *out);
+
+/**
+ * @brief Free a compressor (NULL is ignored).
+ */
+void deflate_stream_free(deflate_stream_t *z);
@@ -0,0 +1,4 @@
+# Compress one web asset for embedding:
+#   cmake -DIN=<file> -DOUT=<file.gz> -P gzip_asset.cmake
+file(ARCHIVE_CREATE OUTPUT "${OUT}" PATHS "${IN}"
+     FORMAT raw COMPRESSION GZip COMPRESSION_LEVEL 9)
@@ -0,0 +1,246 @@
+/*
+ * UBAC:chart.js minimal line chart for the dashboard.
+ * Copyright (C) 2026 Côme VINCENT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Served by the device itself, so the dashboard also works in SoftAP mode.
+// Draws datasets of {x, y} points sorted by x on a linear time axis.
+"use strict";
+
+const CHART_PAD = { left: 52, right: 12, top: 10, bottom: 42 };
+const CHART_TIME_STEPS = [
+  60, 300, 600, 900, 1800, 3600, 7200, 10800, 21600, 43200, 86400, 172800,
+].map((s) => s * 1000);
+
+class LineChart {
+  // opts: datasets [{label, color, data, hidden}], xFormat(ms) for ticks,
+  // tipFormat(ms) for the hover box, yTitle
+  constructor(canvas, opts) {
+    this.canvas = canvas;
+    this.ctx = canvas.getContext("2d");
+    this.data = { datasets: opts.datasets || [] };
+    this.xFormat = opts.xFormat || String;
+    this.tipFormat = opts.tipFormat || this.xFormat;
+    this.yTitle = opts.yTitle || "";
+    this.hoverX = null;
+    this.pending = false;
+
+    canvas.addEventListener("mousemove", (e) => {
+      this.hoverX = e.clientX - canvas.getBoundingClientRect().left;
+      this.redraw();
+    });
+    canvas.addEventListener("mouseleave", () => {
+      this.hoverX = null;
+      this.redraw();
+    });
+    window.addEventListener("resize", () => this.update());
+    this.update();
+  }
+
+  // Call after changing data or hidden flags
+  update() {
+    const dpr = window.devicePixelRatio || 1;
+    const w = this.canvas.clientWidth;
+    const h = this.canvas.clientHeight;
+    if (this.canvas.width !== Math.round(w * dpr) || this.canvas.height !== Math.round(h * dpr)) {
+      this.canvas.width = Math.round(w * dpr);
+      this.canvas.height = Math.round(h * dpr);
+    }
+    this.ctx.setTransform(dpr, 0, 0, dpr, 0, 0);
+    this.w = w;
+    this.h = h;
+    this.bounds();
+    this.draw();
+  }
+
+  redraw() {
+    if (this.pending) return;
+    this.pending = true;
+    requestAnimationFrame(() => {
+      this.pending = false;
+      this.draw();
+    });
+  }
+
+  visible() {
+    return this.data.datasets.filter((d) => !d.hidden && d.data.length);
+  }
+
+  bounds() {
+    let x0 = Infinity, x1 = -Infinity, y0 = Infinity, y1 = -Infinity;
+    for (const d of this.visible()) {
+      x0 = Math.min(x0, d.data[0].x);
+      x1 = Math.max(x1, d.data[d.data.length - 1].x);
+      for (const p of d.data) {
+        if (p.y < y0) y0 = p.y;
+        if (p.y > y1) y1 = p.y;
+      }
+    }
+    if (x0 > x1) {
+      const now = Date.now();
+      [x0, x1, y0, y1] = [now - 3600e3, now, 0, 1];
+    }
+    if (x0 === x1) [x0, x1] = [x0 - 60e3, x1 + 60e3];
+    if (y0 === y1) [y0, y1] = [y0 - 1, y1 + 1];
+
+    this.yStep = niceStep((y1 - y0) / 6);
+    this.y0 = Math.floor(y0 / this.yStep) * this.yStep;
+    this.y1 = Math.ceil(y1 / this.yStep) * this.yStep;
+    this.x0 = x0;
+    this.x1 = x1;
+  }
+
+  px(x) {
+    const pw = this.w - CHART_PAD.left - CHART_PAD.right;
+    return CHART_PAD.left + ((x - this.x0) / (this.x1 - this.x0)) * pw;
+  }
+
+  py(y) {
+    const ph = this.h - CHART_PAD.top - CHART_PAD.bottom;
+    return CHART_PAD.top + (1 - (y - this.y0) / (this.y1 - this.y0)) * ph;
+  }
+
+  draw() {
+    const c = this.ctx;
+    const left = CHART_PAD.left;
+    const right = this.w - CHART_PAD.right;
+    const top = CHART_PAD.top;
+    const bottom = this.h - CHART_PAD.bottom;
+    c.clearRect(0, 0, this.w, this.h);
+    c.font = "11px sans-serif";
+    c.lineWidth = 1;
+    c.strokeStyle = "#e5e5e5";
+    c.fillStyle = "#666";
+
+    // Y grid and labels
+    c.textAlign = "right";
+    c.textBaseline = "middle";
+    for (let y = this.y0; y <= this.y1 + this.yStep / 2; y += this.yStep) {
+      const py = Math.round(this.py(y)) + 0.5;
+      c.beginPath();
+      c.moveTo(left, py);
+      c.lineTo(right, py);
+      c.stroke();
+      c.fillText(+y.toFixed(2), left - 6, py);
+    }
+
+    // Time ticks on round local times
+    const span = this.x1 - this.x0;
+    const step = CHART_TIME_STEPS.find((s) => span / s <= 8) || 7 * 86400e3;
+    const tz = new Date(this.x0).getTimezoneOffset() * 60e3;
+    c.textAlign = "center";
+    c.textBaseline = "top";
+    for (let x = Math.ceil((this.x0 - tz) / step) * step + tz; x <= this.x1; x += step) {
+      const px = Math.round(this.px(x)) + 0.5;
+      c.beginPath();
+      c.moveTo(px, top);
+      c.lineTo(px, bottom);
+      c.stroke();
+      c.fillText(this.xFormat(x), px, bottom + 6);
+    }
+
+    c.fillText("Time", (left + right) / 2, bottom + 24);
+    c.save();
+    c.translate(12, (top + bottom) / 2);
+    c.rotate(-Math.PI / 2);
+    c.fillText(this.yTitle, 0, 0);
+    c.restore();
+
+    // Series, clipped to the plot area
+    c.save();
+    c.beginPath();
+    c.rect(left, top, right - left, bottom - top);
+    c.clip();
+    c.lineWidth = 2;
+    c.lineJoin = "round";
+    for (const d of this.visible()) {
+      c.strokeStyle = d.color;
+      c.beginPath();
+      d.data.forEach((p, i) => {
+        if (i) c.lineTo(this.px(p.x), this.py(p.y));
+        else c.moveTo(this.px(p.x), this.py(p.y));
+      });
+      c.stroke();
+    }
+    c.restore();
+
+    if (this.hoverX !== null && this.hoverX >= left && this.hoverX <= right) {
+      this.drawTip(left, right, top, bottom);
+    }
+  }
+
+  // Nearest point of each visible dataset under the pointer
+  drawTip(left, right, top, bottom) {
+    const c = this.ctx;
+    const x = this.x0 + ((this.hoverX - left) / (right - left)) * (this.x1 - this.x0);
+    const rows = [];
+    let at = null;
+    for (const d of this.visible()) {
+      const p = nearest(d.data, x);
+      rows.push({ color: d.color, text: `${d.label}: ${p.y.toFixed(2)}` });
+      if (at === null || Math.abs(p.x - x) < Math.abs(at - x)) at = p.x;
+    }
+    if (!rows.length) return;
+
+    const px = Math.round(this.px(at)) + 0.5;
+    c.strokeStyle = "#999";
+    c.lineWidth = 1;
+    c.beginPath();
+    c.moveTo(px, top);
+    c.lineTo(px, bottom);
+    c.stroke();
+
+    const title = this.tipFormat(at);
+    const lh = 15;
+    const bw = Math.max(c.measureText(title).width, ...rows.map((r) => c.measureText(r.text).width)) + 28;
+    const bh = (rows.length + 1) * lh + 8;
+    const bx = px + 10 + bw > right ? px - 10 - bw : px + 10;
+    c.fillStyle = "rgba(0, 0, 0, 0.75)";
+    c.fillRect(bx, top + 4, bw, bh);
+    c.textAlign = "left";
+    c.textBaseline = "top";
+    c.fillStyle = "#fff";
+    c.fillText(title, bx + 8, top + 8);
+    rows.forEach((r, i) => {
+      const y = top + 8 + (i + 1) * lh;
+      c.fillStyle = r.color;
+      c.fillRect(bx + 8, y + 2, 9, 9);
+      c.fillStyle = "#fff";
+      c.fillText(r.text, bx + 22, y);
+    });
+  }
+}
+
+// 1, 2 or 5 times a power of ten, at least raw
+function niceStep(raw) {
+  const p = Math.pow(10, Math.floor(Math.log10(raw)));
+  for (const m of [1, 2, 5, 10]) {
+    if (m * p >= raw) return m * p;
+  }
+  return 10 * p;
+}
+
+function nearest(data, x) {
+  let lo = 0;
+  let hi = data.length - 1;
+  while (lo < hi) {
+    const mid = (lo + hi) >> 1;
+    if (data[mid].x < x) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo > 0 && x - data[lo - 1].x < data[lo].x - x) lo--;
+  return data[lo];
+}
@@ -19,104 +19,322 @@
 
 #include "ntc_history.h"
 
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_partition.h"
 #include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
 
 #include <inttypes.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #define STORAGE_PARTITION_LABEL   "storage"
 #define STORAGE_PARTITION_SUBTYPE 0x99
 
-#define SECTOR_SIZE     4096u
-#define SECTOR_HDR_SIZE 64u
-
-// On-flash record layout is 32 bytes.
-#define RECORD_SIZE 32u
+#define SECTOR_SIZE      4096u
+#define SECTOR_HDR_SIZE  64u
+#define SECTOR_DATA_SIZE (SECTOR_SIZE - SECTOR_HDR_SIZE)
+
+// Records are stored as frames: [len][payload][crc16 over len+payload].
+// The first frame of a sector is a keyframe holding absolute values; every
+// following frame holds deltas against the previous record:
+//   - zig-zag varint of the change in timestamp step (usually one 0 byte)
+//   - one nibble per channel with the zig-zag temperature delta, the nibble
+//     value 15 escaping to a zig-zag varint appended after the nibbles.
+// Every flash write starts on a FRAME_ALIGN boundary (ECC unit on ESP32
+// flash) and leaves the rest of its last unit at 0xFF, which is never a valid
+// len byte. Frames of one write are packed back to back.
+#define FRAME_ALIGN       16u
+#define FRAME_OVERHEAD    3u
+#define FRAME_PADDING     0xFFu
+#define NIBBLE_BYTES      ((NTC_CHANNELS_COUNT + 1) / 2)
+#define NIBBLE_ESCAPE     15u
+#define KEYFRAME_PAYLOAD  (4 + (2 * NTC_CHANNELS_COUNT))
+#define DELTA_PAYLOAD_MAX (5 + NIBBLE_BYTES + (3 * NTC_CHANNELS_COUNT))
+#define FRAME_MIN_SIZE    (FRAME_OVERHEAD + 1 + NIBBLE_BYTES)
+#define FRAME_MAX_SIZE \
+  (FRAME_OVERHEAD + ((KEYFRAME_PAYLOAD > DELTA_PAYLOAD_MAX) ? KEYFRAME_PAYLOAD : DELTA_PAYLOAD_MAX))
+#if FRAME_MAX_SIZE - FRAME_OVERHEAD >= FRAME_PADDING
+#error "NTC_CHANNELS_COUNT too large for a one-byte frame length"
+#endif
 
-// Compute dynamic padding required for exactly 32 bytes.
-#define RECORD_PAYLOAD_SIZE (12 + (2 * NTC_CHANNELS_COUNT))
-#if RECORD_PAYLOAD_SIZE > 32
-#error "NTC_CHANNELS_COUNT too large for 32-byte record"
+// Rollup frames carry one bucket: timestamp, sample count, the min/max/mean
+// of every channel and the seq of the newest raw sample, all stored as-is.
+// Frames written before the seq was added are shorter and still decode.
+#define ROLLUP_PAYLOAD_NOSEQ (4 + 2 + (3 * 2 * NTC_CHANNELS_COUNT))
+#define ROLLUP_PAYLOAD       (ROLLUP_PAYLOAD_NOSEQ + 4)
+#define ROLLUP_FRAME_SIZE    (FRAME_OVERHEAD + ROLLUP_PAYLOAD)
+#if ROLLUP_PAYLOAD >= FRAME_PADDING
+#error "NTC_CHANNELS_COUNT too large for a one-byte frame length"
 #endif
-#define RECORD_PADDING (32 - RECORD_PAYLOAD_SIZE)
 
-#define RECORDS_PER_SECTOR ((SECTOR_SIZE - SECTOR_HDR_SIZE) / RECORD_SIZE)
+#define ALIGN_UP(x, a) ((((x) + (a) - 1) / (a)) * (a))
+
+// Upper bound used to size per-sector work buffers
+#define MAX_RECORDS_PER_SECTOR (SECTOR_DATA_SIZE / FRAME_MIN_SIZE)
+// Typical small-delta record plus its share of write padding, used for
+// capacity estimates
+#define NOMINAL_RECORD_BYTES (FRAME_MIN_SIZE + 1)
+
 #define RAM_BUFFER_RECORDS 16
 
-#define SECTOR_MAGIC   0x53454354u   // 'SECT'
-#define FORMAT_VERSION 1u
+// Samples reach flash through a low-priority writer task, so the sensor task
+// never waits on a flash write or erase. 32 samples cover an hour of backlog.
+#define WRITER_QUEUE_LEN   32
+#define WRITER_TASK_STACK  4096
+#define WRITER_TASK_PRIO   (tskIDLE_PRIORITY + 1)
+
+#define NO_SPARE UINT32_MAX
+
+#define RTC_BUF_MAGIC    0x52414D42u   // 'RAMB'
+#define SHUTDOWN_LOCK_MS 500
+
+// Each ring has its own magic so that resizing the regions never makes one
+// ring adopt the sectors of another.
+#define SECTOR_MAGIC   0x53454354u   // 'SECT', raw records
+#define ROLLUP_MAGIC   0x524F4C00u   // 'ROL' + tier number
+#define FORMAT_VERSION 4u
+#define FORMAT_VERSION_MIN 3u   // v3 headers lack the wear fields
 
 static const char *TAG = "NTC_HISTORY";
 
 typedef struct __attribute__((packed))
 {
-  uint32_t magic;       // SECTOR_MAGIC
+  uint32_t magic;       // SECTOR_MAGIC / ROLLUP_MAGIC
   uint32_t version;     // FORMAT_VERSION
   uint32_t seq_start;   // sequence number for first record in sector
-  uint32_t hdr_crc32;   // CRC32 over version+seq_start
-  uint8_t pad[SECTOR_HDR_SIZE - 16];
+  uint32_t ts_start;    // newest record timestamp written before this sector
+  uint32_t hdr_crc32;   // CRC32 over version+seq_start+ts_start, then
+                        // (v4) erase_count+bytes_written
+  uint32_t erase_count;     // times this sector has been erased
+  uint64_t bytes_written;   // bytes programmed into the ring before it
+  uint8_t pad[SECTOR_HDR_SIZE - 32];
 } sector_hdr_t;
 
 _Static_assert(sizeof(sector_hdr_t) == SECTOR_HDR_SIZE, "sector_hdr_t size");
 
-typedef struct __attribute__((packed))
+#define SECTOR_HDR_CRC_LEN \
+  (offsetof(sector_hdr_t, hdr_crc32) - offsetof(sector_hdr_t, version))
+#define SECTOR_HDR_WEAR_LEN \
+  (offsetof(sector_hdr_t, pad) - offsetof(sector_hdr_t, erase_count))
+
+typedef struct
 {
-  uint32_t seq;         // monotonic
-  uint32_t timestamp;   // unix seconds
+  uint32_t timestamp;
   int16_t temps_cC[NTC_CHANNELS_COUNT];
-#if RECORD_PADDING > 0
-  uint8_t pad[RECORD_PADDING];
-#endif
-  uint32_t rec_crc32;   // CRC over everything up to this struct member
-} record_flash_t;
-
-_Static_assert(sizeof(record_flash_t) == RECORD_SIZE, "record_flash_t size");
+} record_ram_t;
 
+// Delta chain state, reset at every sector start
 typedef struct
 {
+  bool has_key;
   uint32_t timestamp;
+  int32_t step;   // previous timestamp step
   int16_t temps_cC[NTC_CHANNELS_COUNT];
-} record_ram_t;
+} codec_state_t;
+
+typedef enum
+{
+  RING_RAW,
+  RING_ROLLUP,
+} ring_kind_t;
+
+typedef union
+{
+  ntc_record_t rec;
+  ntc_rollup_t row;
+} ring_item_t;
+
+typedef struct
+{
+  ring_kind_t kind;
+  const uint8_t *sector;   // whole sector image
+  bool verify;             // check frame CRCs (sector not verified yet)
+  uint32_t off;            // offset of the next frame
+  codec_state_t st;
+} sector_cursor_t;
+
+typedef enum
+{
+  CURSOR_RECORD,
+  CURSOR_END,
+  CURSOR_CORRUPT,
+} cursor_res_t;
+
+// Every record stored in a sector has a timestamp <= the ts_start of any later
+// sector (ts_start is a running maximum, so it also survives clock steps), which
+// gives each sector the time bounds [own ts_start, next ts_start].
+typedef struct
+{
+  uint32_t seq_start;   // 0 when the sector holds no valid header
+  uint32_t ts_start;
+} sector_meta_t;
+
+// Readers never take s_lock while walking sectors. Each sector has a
+// generation counter that the writer makes odd before the sector is erased
+// and even again once its new header is written; a reader remembers the
+// generation from its snapshot and drops the rest of a sector as soon as it
+// changes.
+//
+// A sealed sector cannot change until it is erased, so once every frame of it
+// has passed its CRC its generation is stored in verified_gen and later reads
+// skip the CRCs.
+typedef struct
+{
+  atomic_uint gen;
+  atomic_uint verified_gen;
+} sector_sync_t;
 
 typedef struct
 {
   uint32_t sector_idx;
   uint32_t seq_start;
+  uint32_t ts_start;
+  uint32_t gen;
+  bool verified;
 } sector_info_t;
 
+// A circular log over a contiguous region of the partition. The raw samples
+// and every rollup tier each live in their own ring.
+typedef struct
+{
+  const char *name;
+  ring_kind_t kind;
+  uint32_t magic;
+  uint32_t first_sector;   // partition sector where the region starts
+  uint32_t sector_count;
+  uint32_t cur_sector;     // region-relative
+  uint32_t cur_off;        // next write offset in sector
+  codec_state_t enc;       // delta chain of cur sector (raw ring)
+  uint32_t last_seq;
+  uint32_t ts_hwm;         // newest timestamp written so far
+  uint32_t spare;          // erased sector following cur_sector, or NO_SPARE
+
+  // Header summary of every sector, indexed by region-relative sector. Built
+  // once at init and kept in sync by advance_sector(), so queries never have
+  // to re-read sector headers. Sectors are written circularly, so walking from
+  // cur_sector + 1 yields them oldest -> newest.
+  sector_meta_t *sectors;
+  sector_sync_t *sync;
+
+  // Wear accounting, persisted in every sector header. erases[] is 0 for a
+  // sector whose count is not known (blank or v3 header).
+  uint32_t *erases;
+  uint64_t bytes_written;   // lifetime, header and padding included
+  uint64_t bytes_boot;      // bytes_written when this boot started
+
+  // Sequence lock over sectors[], cur_sector and last_seq: odd while the
+  // writer (holding s_lock) updates them, so lock-free readers retry.
+  atomic_uint index_seq;
+} ring_t;
+
+// Running aggregate of the bucket a tier is currently filling
+typedef struct
+{
+  uint32_t bucket_start;
+  uint16_t count;
+  uint16_t valid[NTC_CHANNELS_COUNT];
+  int32_t sum[NTC_CHANNELS_COUNT];
+  int16_t min_cC[NTC_CHANNELS_COUNT];
+  int16_t max_cC[NTC_CHANNELS_COUNT];
+  uint32_t raw_seq;
+} rollup_acc_t;
+
+typedef enum
+{
+  WRITER_RECORD,
+  WRITER_FLUSH,
+} writer_op_t;
+
+typedef struct
+{
+  writer_op_t op;
+  union
+  {
+    record_ram_t rec;             // WRITER_RECORD
+    SemaphoreHandle_t done;       // WRITER_FLUSH, given once flushed
+  };
+} writer_msg_t;
+
 static const esp_partition_t *s_part = NULL;
 static SemaphoreHandle_t s_lock = NULL;
-
-static uint32_t s_sector_count = 0;
-static uint32_t s_cur_sector = 0;
-static uint32_t s_cur_slot = 0;
-static uint32_t s_last_seq = 0;
+static const uint8_t *s_map = NULL;   // whole partition, read-only
+static esp_partition_mmap_handle_t s_map_handle;
+static QueueHandle_t s_queue = NULL;
+static TaskHandle_t s_writer = NULL;
 static bool s_ready = false;
 
-static record_ram_t s_ram_buf[RAM_BUFFER_RECORDS];
-static size_t s_ram_count = 0;
+// Erase and write counters are updated under s_lock; the queue counters only
+// by the task calling ntc_history_add_record(). CRC failures are seen by
+// lock-free readers too.
+static ntc_history_stats_t s_stats;
+static atomic_uint s_crc_failures;
+static volatile uint32_t s_queue_max = 0;
+static ntc_history_live_cb_t s_live_cb = NULL;
+static void *s_live_ctx = NULL;
+static volatile uint32_t s_dropped = 0;
+
+// Last sweep, published by the sensor task; readers copy it and retry if
+// it was replaced meanwhile (sequence lock, odd while being written)
+static ntc_latest_t s_latest;
+static atomic_uint s_latest_seq;
+_Static_assert(NTC_CHANNELS_COUNT <= 32, "valid_mask is 32 bits");
+static uint32_t s_hdr_reads = 0;   // boot cost, for the init log
+
+static ring_t s_raw = {.name = "raw", .kind = RING_RAW, .magic = SECTOR_MAGIC};
+static ring_t s_tiers[NTC_HISTORY_TIERS] = {
+    {.name = "tier1", .kind = RING_ROLLUP, .magic = ROLLUP_MAGIC | 1},
+    {.name = "tier2", .kind = RING_ROLLUP, .magic = ROLLUP_MAGIC | 2},
+};
+static const uint32_t s_tier_interval[NTC_HISTORY_TIERS] = {
+    NTC_HISTORY_TIER1_INTERVAL_SEC,
+    NTC_HISTORY_TIER2_INTERVAL_SEC,
+};
+static const uint32_t s_tier_sectors[NTC_HISTORY_TIERS] = {
+    NTC_HISTORY_TIER1_SECTORS,
+    NTC_HISTORY_TIER2_SECTORS,
+};
+static rollup_acc_t s_acc[NTC_HISTORY_TIERS];
+
+// Samples not yet on flash. Kept in RTC slow memory, which survives panics,
+// watchdog, brownout and software resets (but not power loss), and replayed
+// at init. base_seq is the raw ring's last_seq when the buffer was last
+// synced with flash, so records flushed just before a reset are not written
+// twice.
+typedef struct
+{
+  uint32_t magic;   // RTC_BUF_MAGIC
+  uint32_t base_seq;
+  uint32_t count;
+  record_ram_t recs[RAM_BUFFER_RECORDS];
+  uint32_t crc32;   // over all fields above
+} rtc_buf_t;
+
+static RTC_NOINIT_ATTR rtc_buf_t s_rtc;
 
 static uint32_t crc32_le(const void *data, size_t len)
 {
   return esp_rom_crc32_le(0, (const uint8_t *) data, len);
 }
 
-static uint32_t sector_offset(uint32_t sector_idx)
+static uint16_t crc16_le(const void *data, size_t len)
 {
-  return sector_idx * SECTOR_SIZE;
+  return esp_rom_crc16_le(0, (const uint8_t *) data, len);
 }
 
-static uint32_t record_offset(uint32_t sector_idx, uint32_t slot_idx)
+static uint32_t sector_offset(const ring_t *r, uint32_t sector_idx)
 {
-  return sector_offset(sector_idx) + SECTOR_HDR_SIZE +
-         (slot_idx * RECORD_SIZE);
+  return (r->first_sector + sector_idx) * SECTOR_SIZE;
 }
 
 static int16_t float_to_cC(float temp_c)
@@ -134,450 +352,2484 @@ static int16_t float_to_cC(float temp_c)
   return (int16_t) v;
 }
 
-static bool read_sector_hdr(uint32_t sector_idx, sector_hdr_t *out_hdr)
-{
-  if (esp_partition_read(s_part, sector_offset(sector_idx), out_hdr,
-                         sizeof(*out_hdr)) != ESP_OK)
-  {
-    return false;
-  }
-
-  if (out_hdr->magic != SECTOR_MAGIC || out_hdr->version != FORMAT_VERSION)
-  {
-    return false;
-  }
-
-  uint32_t expected = crc32_le(&out_hdr->version, 8);
-  return expected == out_hdr->hdr_crc32;
-}
-
-static bool read_record(uint32_t sector_idx, uint32_t slot_idx,
-                        record_flash_t *out_rec)
+static uint32_t zigzag(int32_t v)
 {
-  return esp_partition_read(s_part, record_offset(sector_idx, slot_idx),
-                            out_rec, sizeof(*out_rec)) == ESP_OK;
+  return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
 }
 
-static bool record_is_empty(const record_flash_t *r)
+static int32_t unzigzag(uint32_t v)
 {
-  return r->seq == 0xFFFFFFFFu;
+  return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
 }
 
-static bool record_is_valid(const record_flash_t *r)
+static size_t put_varint(uint8_t *p, uint32_t v)
 {
-  if (r->seq == 0 || r->seq == 0xFFFFFFFFu)
+  size_t n = 0;
+  while (v >= 0x80)
   {
-    return false;
+    p[n++] = (uint8_t) (v | 0x80);
+    v >>= 7;
   }
-
-  uint32_t expected = crc32_le(r, offsetof(record_flash_t, rec_crc32));
-  return expected == r->rec_crc32;
-}
-
-static esp_err_t write_sector_hdr(uint32_t sector_idx, uint32_t seq_start)
-{
-  sector_hdr_t hdr;
-  memset(&hdr, 0xFF, sizeof(hdr));
-
-  hdr.magic = SECTOR_MAGIC;
-  hdr.version = FORMAT_VERSION;
-  hdr.seq_start = seq_start;
-  hdr.hdr_crc32 = crc32_le(&hdr.version, 8);
-
-  // Single aligned write (required for ESP32 ECC flash)
-  return esp_partition_write(s_part, sector_offset(sector_idx), &hdr,
-                             sizeof(hdr));
+  p[n++] = (uint8_t) v;
+  return n;
 }
 
-static size_t collect_sectors(sector_info_t *out, size_t max)
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint32_t *out)
 {
-  size_t n = 0;
-  for (uint32_t i = 0; i < s_sector_count && n < max; i++)
+  uint32_t v = 0;
+  for (unsigned shift = 0; shift < 35 && *p < end; shift += 7)
   {
-    sector_hdr_t hdr;
-    if (!read_sector_hdr(i, &hdr))
+    uint8_t b = *(*p)++;
+    v |= (uint32_t) (b & 0x7F) << shift;
+    if (!(b & 0x80))
     {
-      continue;
+      *out = v;
+      return true;
     }
-    out[n++] = (sector_info_t) {.sector_idx = i, .seq_start = hdr.seq_start};
   }
-  return n;
+  return false;
 }
 
-static void sort_sectors_by_seq_start(sector_info_t *s, size_t n)
+// Complete a frame whose payload is already at frame + 1. Returns its size.
+static size_t frame_seal(uint8_t *frame, size_t payload_len)
 {
-  for (size_t i = 0; i < n; i++)
-  {
-    size_t best = i;
-    for (size_t j = i + 1; j < n; j++)
-    {
-      if (s[j].seq_start < s[best].seq_start)
-        best = j;
-    }
-    if (best != i)
-    {
-      sector_info_t tmp = s[i];
-      s[i] = s[best];
-      s[best] = tmp;
-    }
-  }
+  frame[0] = (uint8_t) payload_len;
+
+  uint16_t crc = crc16_le(frame, 1 + payload_len);
+  frame[1 + payload_len] = (uint8_t) (crc & 0xFF);
+  frame[2 + payload_len] = (uint8_t) (crc >> 8);
+  return FRAME_OVERHEAD + payload_len;
 }
 
-static esp_err_t advance_sector(void)
+// Payload length of the frame at `frame`, or 0 if it is torn or corrupt.
+// The CRC is only checked when verify is set.
+static size_t frame_check(const uint8_t *frame, size_t avail, bool verify)
 {
-  uint32_t next = (s_cur_sector + 1) % s_sector_count;
+  if (avail < FRAME_OVERHEAD)
+    return 0;
 
-  esp_err_t err =
-      esp_partition_erase_range(s_part, sector_offset(next), SECTOR_SIZE);
-  if (err != ESP_OK)
-    return err;
+  size_t len = frame[0];
+  if (len == 0 || FRAME_OVERHEAD + len > avail)
+    return 0;
 
-  err = write_sector_hdr(next, s_last_seq + 1);
-  if (err != ESP_OK)
-    return err;
+  if (!verify)
+    return len;
 
-  s_cur_sector = next;
-  s_cur_slot = 0;
-  return ESP_OK;
+  uint16_t crc = (uint16_t) (frame[1 + len] | (frame[2 + len] << 8));
+  if (crc16_le(frame, 1 + len) != crc)
+  {
+    atomic_fetch_add(&s_crc_failures, 1);
+    return 0;
+  }
+  return len;
 }
 
-static void scan_current_sector_tail(void)
+// Encode one record against the delta chain in st (a keyframe when st holds
+// none yet) and advance st. Returns the frame size.
+static size_t encode_record(codec_state_t *st, uint32_t timestamp,
+                            const int16_t temps_cC[NTC_CHANNELS_COUNT],
+                            uint8_t *frame)
 {
-  for (uint32_t slot = 0; slot < RECORDS_PER_SECTOR; slot++)
-  {
-    record_flash_t r;
-    if (!read_record(s_cur_sector, slot, &r))
-    {
-      s_cur_slot = RECORDS_PER_SECTOR;
-      return;
-    }
+  uint8_t *p = frame + 1;
 
-    if (record_is_empty(&r))
-    {
-      s_cur_slot = slot;
-      return;
-    }
+  if (!st->has_key)
+  {
+    memcpy(p, &timestamp, sizeof(timestamp));
+    p += sizeof(timestamp);
+    memcpy(p, temps_cC, 2 * NTC_CHANNELS_COUNT);
+    p += 2 * NTC_CHANNELS_COUNT;
+    st->step = NTC_DELAY_SEC;
+  }
+  else
+  {
+    int32_t step = (int32_t) (timestamp - st->timestamp);
+    p += put_varint(p, zigzag(step - st->step));
+    st->step = step;
 
-    if (!record_is_valid(&r))
-    {
-      s_cur_slot = RECORDS_PER_SECTOR;
-      return;
-    }
+    uint8_t *nibbles = p;
+    memset(nibbles, 0, NIBBLE_BYTES);
+    p += NIBBLE_BYTES;
 
-    if (r.seq > s_last_seq)
+    for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
     {
-      s_last_seq = r.seq;
+      uint32_t z = zigzag((int32_t) temps_cC[ch] - st->temps_cC[ch]);
+      uint32_t nib = (z < NIBBLE_ESCAPE) ? z : NIBBLE_ESCAPE;
+      if (nib == NIBBLE_ESCAPE)
+      {
+        p += put_varint(p, z);
+      }
+      nibbles[ch / 2] |= (uint8_t) (nib << ((ch & 1) * 4));
     }
   }
 
-  s_cur_slot = RECORDS_PER_SECTOR;
+  st->has_key = true;
+  st->timestamp = timestamp;
+  memcpy(st->temps_cC, temps_cC, sizeof(st->temps_cC));
+
+  return frame_seal(frame, (size_t) (p - (frame + 1)));
 }
 
-static esp_err_t write_one_record(uint32_t timestamp,
-                                  const int16_t temps_cC[NTC_CHANNELS_COUNT])
+// Decode a record payload and advance st. Returns false on malformed data.
+static bool decode_record(codec_state_t *st, const uint8_t *p, size_t len,
+                          ntc_record_t *out)
 {
-  if (s_cur_slot >= RECORDS_PER_SECTOR)
+  const uint8_t *end = p + len;
+
+  if (!st->has_key)
   {
-    esp_err_t err = advance_sector();
-    if (err != ESP_OK)
-      return err;
+    if (len != KEYFRAME_PAYLOAD)
+      return false;
+    memcpy(&st->timestamp, p, sizeof(st->timestamp));
+    p += sizeof(st->timestamp);
+    memcpy(st->temps_cC, p, 2 * NTC_CHANNELS_COUNT);
+    st->step = NTC_DELAY_SEC;
+    st->has_key = true;
   }
+  else
+  {
+    uint32_t z;
+    if (!get_varint(&p, end, &z))
+      return false;
+    st->step += unzigzag(z);
+    st->timestamp += (uint32_t) st->step;
+
+    if (end - p < NIBBLE_BYTES)
+      return false;
+    const uint8_t *nibbles = p;
+    p += NIBBLE_BYTES;
+
+    for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+    {
+      z = (nibbles[ch / 2] >> ((ch & 1) * 4)) & 0x0F;
+      if (z == NIBBLE_ESCAPE && !get_varint(&p, end, &z))
+        return false;
+      st->temps_cC[ch] = (int16_t) (st->temps_cC[ch] + unzigzag(z));
+    }
 
-  record_flash_t rec;
-  memset(&rec, 0xFF, sizeof(rec));
+    if (p != end)
+      return false;
+  }
 
-  rec.seq = s_last_seq + 1;
-  rec.timestamp = timestamp;
-  memcpy(rec.temps_cC, temps_cC, sizeof(rec.temps_cC));
-  rec.rec_crc32 = crc32_le(&rec, offsetof(record_flash_t, rec_crc32));
+  out->timestamp = st->timestamp;
+  memcpy(out->temps_cC, st->temps_cC, sizeof(out->temps_cC));
+  return true;
+}
 
-  uint32_t off = record_offset(s_cur_sector, s_cur_slot);
+static size_t encode_rollup(const ntc_rollup_t *row, uint8_t *frame)
+{
+  uint8_t *p = frame + 1;
+
+  memcpy(p, &row->timestamp, sizeof(row->timestamp));
+  p += sizeof(row->timestamp);
+  memcpy(p, &row->count, sizeof(row->count));
+  p += sizeof(row->count);
+  memcpy(p, row->min_cC, sizeof(row->min_cC));
+  p += sizeof(row->min_cC);
+  memcpy(p, row->max_cC, sizeof(row->max_cC));
+  p += sizeof(row->max_cC);
+  memcpy(p, row->mean_cC, sizeof(row->mean_cC));
+  p += sizeof(row->mean_cC);
+  memcpy(p, &row->raw_seq, sizeof(row->raw_seq));
+  p += sizeof(row->raw_seq);
+
+  return frame_seal(frame, (size_t) (p - (frame + 1)));
+}
 
-  // Single 32-byte write phase for Flash ECC compliance
-  esp_err_t err = esp_partition_write(s_part, off, &rec, sizeof(rec));
-  if (err != ESP_OK)
-    return err;
+static bool decode_rollup(const uint8_t *p, size_t len, ntc_rollup_t *out)
+{
+  if (len != ROLLUP_PAYLOAD && len != ROLLUP_PAYLOAD_NOSEQ)
+    return false;
 
-  s_last_seq = rec.seq;
-  s_cur_slot++;
-  return ESP_OK;
+  memcpy(&out->timestamp, p, sizeof(out->timestamp));
+  p += sizeof(out->timestamp);
+  memcpy(&out->count, p, sizeof(out->count));
+  p += sizeof(out->count);
+  memcpy(out->min_cC, p, sizeof(out->min_cC));
+  p += sizeof(out->min_cC);
+  memcpy(out->max_cC, p, sizeof(out->max_cC));
+  p += sizeof(out->max_cC);
+  memcpy(out->mean_cC, p, sizeof(out->mean_cC));
+  p += sizeof(out->mean_cC);
+  out->raw_seq = 0;
+  if (len == ROLLUP_PAYLOAD)
+    memcpy(&out->raw_seq, p, sizeof(out->raw_seq));
+  return true;
 }
 
-// Caller must hold s_lock!
-static void flush_locked(void)
+static void cursor_init(sector_cursor_t *c, ring_kind_t kind,
+                        const uint8_t *sector, bool verify)
 {
-  size_t i;
-  for (i = 0; i < s_ram_count; i++)
-  {
-    esp_err_t err =
-        write_one_record(s_ram_buf[i].timestamp, s_ram_buf[i].temps_cC);
-    if (err != ESP_OK)
-    {
-      ESP_LOGE(TAG, "write_one_record failed: %s", esp_err_to_name(err));
-      break;
-    }
-  }
+  c->kind = kind;
+  c->sector = sector;
+  c->verify = verify;
+  c->off = SECTOR_HDR_SIZE;
+  memset(&c->st, 0, sizeof(c->st));
+}
 
-  // If writes fail mid-way, shift remaining to front instead of dropping
-  if (i > 0)
+static cursor_res_t cursor_next(sector_cursor_t *c, ring_item_t *out)
+{
+  // 0xFF where a len byte is expected is write padding; on a unit boundary it
+  // marks the end of written data.
+  while (c->off < SECTOR_SIZE && c->sector[c->off] == FRAME_PADDING)
   {
-    size_t remaining = s_ram_count - i;
-    if (remaining > 0)
-    {
-      memmove(s_ram_buf, &s_ram_buf[i], remaining * sizeof(record_ram_t));
-    }
-    s_ram_count = remaining;
+    if (c->off % FRAME_ALIGN == 0)
+      return CURSOR_END;
+    c->off = ALIGN_UP(c->off, FRAME_ALIGN);
   }
+  if (c->off >= SECTOR_SIZE)
+    return CURSOR_END;
+
+  const uint8_t *frame = c->sector + c->off;
+  size_t len = frame_check(frame, SECTOR_SIZE - c->off, c->verify);
+  if (len == 0)
+    return CURSOR_CORRUPT;
+
+  bool ok = (c->kind == RING_RAW)
+                ? decode_record(&c->st, frame + 1, len, &out->rec)
+                : decode_rollup(frame + 1, len, &out->row);
+  if (!ok)
+    return CURSOR_CORRUPT;
+
+  c->off += FRAME_OVERHEAD + len;
+  return CURSOR_RECORD;
 }
 
-void ntc_history_init(void)
+static uint32_t item_timestamp(const ring_t *r, const ring_item_t *it)
 {
-  s_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
-                                    STORAGE_PARTITION_SUBTYPE,
-                                    STORAGE_PARTITION_LABEL);
-  if (!s_part)
-  {
-    ESP_LOGE(TAG, "Could not find storage partition, will not log NTC history");
-    s_ready = false;
-    return;
-  }
+  return (r->kind == RING_RAW) ? it->rec.timestamp : it->row.timestamp;
+}
 
-  if (s_part->erase_size != SECTOR_SIZE)
+static uint32_t sector_hdr_crc(const sector_hdr_t *hdr)
+{
+  uint32_t crc = crc32_le(&hdr->version, SECTOR_HDR_CRC_LEN);
+  if (hdr->version >= 4)
   {
-    ESP_LOGE(TAG, "Unexpected erase size=%" PRIu32, s_part->erase_size);
-    s_ready = false;
-    return;
+    crc = esp_rom_crc32_le(crc, (const uint8_t *) &hdr->erase_count,
+                           SECTOR_HDR_WEAR_LEN);
   }
+  return crc;
+}
 
-  s_sector_count = s_part->size / SECTOR_SIZE;
-  if (s_sector_count == 0)
+static bool read_sector_hdr(const ring_t *r, uint32_t sector_idx,
+                            sector_hdr_t *out_hdr)
+{
+  s_hdr_reads++;
+  if (esp_partition_read(s_part, sector_offset(r, sector_idx), out_hdr,
+                         sizeof(*out_hdr)) != ESP_OK)
   {
-    ESP_LOGE(TAG, "Partition too small");
-    s_ready = false;
-    return;
+    return false;
   }
 
-  if (!s_lock)
+  if (out_hdr->magic != r->magic || out_hdr->version < FORMAT_VERSION_MIN ||
+      out_hdr->version > FORMAT_VERSION)
   {
-    s_lock = xSemaphoreCreateMutex();
+    return false;
   }
 
-  xSemaphoreTake(s_lock, portMAX_DELAY);
-
-  bool found_any = false;
-  uint32_t best_sector = 0;
-  uint32_t best_seq_start = 0;
-
-  for (uint32_t i = 0; i < s_sector_count; i++)
+  if (sector_hdr_crc(out_hdr) != out_hdr->hdr_crc32)
   {
-    sector_hdr_t hdr;
-    if (!read_sector_hdr(i, &hdr))
-      continue;
-
-    if (!found_any || hdr.seq_start > best_seq_start)
-    {
-      found_any = true;
-      best_sector = i;
-      best_seq_start = hdr.seq_start;
-    }
+    atomic_fetch_add(&s_crc_failures, 1);
+    return false;
   }
 
-  s_last_seq = 0;
-  s_cur_sector = 0;
-  s_cur_slot = 0;
-
-  if (!found_any)
-  {
-    ESP_LOGI(TAG, "No valid log (format v%u); initializing sector 0",
-             (unsigned) FORMAT_VERSION);
-
-    ESP_ERROR_CHECK(
-        esp_partition_erase_range(s_part, sector_offset(0), SECTOR_SIZE));
-    ESP_ERROR_CHECK(write_sector_hdr(0, 1));
-  }
-  else
+  if (out_hdr->version < 4)
   {
-    s_cur_sector = best_sector;
-    s_last_seq = best_seq_start - 1;
-    scan_current_sector_tail();
-
-    if (s_cur_slot >= RECORDS_PER_SECTOR)
-    {
-      ESP_ERROR_CHECK(advance_sector());
-    }
+    // Written before wear tracking: counts start from here
+    out_hdr->erase_count = 0;
+    out_hdr->bytes_written = 0;
   }
-
-  s_ready = true;
-
-  ESP_LOGI(TAG,
-           "Init ok: sectors=%" PRIu32 " records/sector=%u capacity=%u "
-           "cur_sector=%" PRIu32 " cur_slot=%" PRIu32 " last_seq=%" PRIu32,
-           s_sector_count, (unsigned) RECORDS_PER_SECTOR,
-           (unsigned) ntc_history_get_capacity(), s_cur_sector, s_cur_slot,
-           s_last_seq);
-
-  xSemaphoreGive(s_lock);
+  return true;
 }
 
-void ntc_history_add_record(const float temps[NTC_CHANNELS_COUNT])
+// Whole sector image. With the partition mapped this points straight into
+// flash through the cache; otherwise the sector is copied into buf, which
+// must then hold SECTOR_SIZE bytes.
+static const uint8_t *sector_view(const ring_t *r, uint32_t sector_idx,
+                                  uint8_t *buf)
 {
-  if (!s_ready)
-    return;
+  if (s_map)
+    return s_map + sector_offset(r, sector_idx);
 
-  record_ram_t r;
-  r.timestamp = (uint32_t) time(NULL);
-  for (int i = 0; i < NTC_CHANNELS_COUNT; i++)
-  {
-    r.temps_cC[i] = float_to_cC(temps[i]);
-  }
-
-  xSemaphoreTake(s_lock, portMAX_DELAY);
-
-  if (s_ram_count >= RAM_BUFFER_RECORDS)
+  if (!buf || esp_partition_read(s_part, sector_offset(r, sector_idx), buf,
+                                 SECTOR_SIZE) != ESP_OK)
   {
-    flush_locked();
+    return NULL;
   }
+  return buf;
+}
 
-  if (s_ram_count < RAM_BUFFER_RECORDS)
-  {
-    s_ram_buf[s_ram_count++] = r;
-  }
+// Bounce buffer for sector_view(), only needed when the partition is not
+// mapped. Returns false if it is needed and cannot be allocated.
+static bool sector_buf_alloc(uint8_t **buf)
+{
+  *buf = s_map ? NULL : malloc(SECTOR_SIZE);
+  return s_map || *buf;
+}
 
-  if (s_ram_count >= RAM_BUFFER_RECORDS)
+static uint32_t latency_bucket(uint32_t us)
+{
+  uint32_t bucket = 0;
+  uint32_t limit = NTC_HISTORY_LAT_BASE_US;
+  while (bucket < NTC_HISTORY_LAT_BUCKETS - 1 && us >= limit)
   {
-    flush_locked();
+    limit <<= 2;
+    bucket++;
   }
-
-  xSemaphoreGive(s_lock);
+  return bucket;
 }
 
-void ntc_history_flush(void)
+// Every program operation of a ring goes through here for the wear
+// accounting. Caller holds s_lock.
+static esp_err_t ring_program(ring_t *r, uint32_t offset, const void *src,
+                              size_t len)
 {
-  if (!s_ready)
-    return;
+  int64_t t0 = esp_timer_get_time();
+  esp_err_t err = esp_partition_write(s_part, offset, src, len);
+  uint32_t us = (uint32_t) (esp_timer_get_time() - t0);
+
+  s_stats.write_hist[latency_bucket(us)]++;
+  // Counted even on failure: part of the range may have been programmed
+  r->bytes_written += len;
+  return err;
+}
 
-  xSemaphoreTake(s_lock, portMAX_DELAY);
-  flush_locked();
-  xSemaphoreGive(s_lock);
+// Sectors are erased in ring order, so the sector after the write head is
+// one cycle behind it. A count that is not known (blank, spare or v3 header)
+// is estimated that way, which also gives 0 on the first pass over a new
+// ring.
+static uint32_t sector_erases(const ring_t *r, uint32_t sector_idx)
+{
+  if (r->erases[sector_idx] != 0)
+    return r->erases[sector_idx];
+  uint32_t head = r->erases[r->cur_sector];
+  return (head > 0) ? head - 1 : 0;
 }
 
-size_t ntc_history_get_capacity(void)
+// Caller holds s_lock.
+static void note_wear(ring_t *r, uint32_t sector_idx)
 {
-  if (!s_part)
-    return 0;
-  return (size_t) s_sector_count * (size_t) RECORDS_PER_SECTOR;
+  r->erases[sector_idx] = sector_erases(r, sector_idx) + 1;
 }
 
-size_t ntc_history_iterate(uint32_t since_ts, size_t max,
-                           ntc_history_iter_cb_t cb, void *ctx)
+static esp_err_t write_sector_hdr(ring_t *r, uint32_t sector_idx,
+                                  uint32_t seq_start, uint32_t ts_start)
 {
-  if (!s_ready)
-    return 0;
-  if (max == 0)
-    max = (size_t) -1;
+  sector_hdr_t hdr;
+  memset(&hdr, 0xFF, sizeof(hdr));
 
-  xSemaphoreTake(s_lock, portMAX_DELAY);
+  hdr.magic = r->magic;
+  hdr.version = FORMAT_VERSION;
+  hdr.seq_start = seq_start;
+  hdr.ts_start = ts_start;
+  hdr.erase_count = sector_erases(r, sector_idx);
+  hdr.bytes_written = r->bytes_written;
+  hdr.hdr_crc32 = sector_hdr_crc(&hdr);
+  r->erases[sector_idx] = hdr.erase_count;   // settles an estimated count
 
-  // Dynamically allocate to avoid truncating partitions larger than 512KB
-  sector_info_t *sectors = malloc(s_sector_count * sizeof(sector_info_t));
-  if (!sectors)
-  {
-    xSemaphoreGive(s_lock);
-    return 0;
-  }
+  // Single aligned write (required for ESP32 ECC flash)
+  return ring_program(r, sector_offset(r, sector_idx), &hdr, sizeof(hdr));
+}
 
-  size_t nsec = collect_sectors(sectors, s_sector_count);
-  sort_sectors_by_seq_start(sectors, nsec);
+// Writer side of the index sequence lock. Caller holds s_lock, and no flash
+// operation may run in between.
+static void index_begin(ring_t *r)
+{
+  unsigned seq = atomic_load_explicit(&r->index_seq, memory_order_relaxed);
+  atomic_store_explicit(&r->index_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
 
-  // Iterator releases lock during callback logic to prevent deadlocks
-  xSemaphoreGive(s_lock);
+static void index_end(ring_t *r)
+{
+  unsigned seq = atomic_load_explicit(&r->index_seq, memory_order_relaxed);
+  atomic_store_explicit(&r->index_seq, seq + 1, memory_order_release);
+}
 
-  size_t emitted = 0;
+// Take a sector out of the index before its contents go away. Caller is
+// inside index_begin()/index_end().
+static void sector_retire(ring_t *r, uint32_t sector_idx)
+{
+  r->sectors[sector_idx] = (sector_meta_t) {0};
+  if ((atomic_load(&r->sync[sector_idx].gen) & 1) == 0)
+    atomic_fetch_add(&r->sync[sector_idx].gen, 1);
+}
 
-  // Read whole sector to drastically reduce IO overhead stalling system
-  uint8_t *sec_buf = malloc(SECTOR_SIZE);
-  if (!sec_buf)
-  {
-    free(sectors);
-    return 0;
-  }
+// Put a sector whose header is written back into the index. Caller is inside
+// index_begin()/index_end().
+static void sector_publish(ring_t *r, uint32_t sector_idx,
+                           uint32_t seq_start, uint32_t ts_start)
+{
+  r->sectors[sector_idx] =
+      (sector_meta_t) {.seq_start = seq_start, .ts_start = ts_start};
+  if (atomic_load(&r->sync[sector_idx].gen) & 1)
+    atomic_fetch_add(&r->sync[sector_idx].gen, 1);
+}
 
-  for (size_t si = 0; si < nsec; si++)
-  {
-    uint32_t sector = sectors[si].sector_idx;
+// True while a snapshot sector has not been recycled. Call after reading
+// from the sector, before trusting what was read.
+static bool sector_unchanged(const ring_t *r, const sector_info_t *info)
+{
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&r->sync[info->sector_idx].gen,
+                              memory_order_relaxed) == info->gen;
+}
 
-    if (esp_partition_read(s_part, sector_offset(sector), sec_buf,
-                           SECTOR_SIZE) != ESP_OK)
+// Copy the in-RAM index in ring order (oldest -> newest) without taking
+// s_lock; retries while the writer is updating it.
+static size_t snapshot_sectors(const ring_t *r, sector_info_t *out,
+                               uint32_t *last_seq)
+{
+  for (;;)
+  {
+    unsigned begin = atomic_load_explicit(&r->index_seq, memory_order_acquire);
+    if (begin & 1)
     {
+      // Let the (lower priority) writer finish its few stores
+      vTaskDelay(1);
       continue;
     }
 
-    for (uint32_t slot = 0; slot < RECORDS_PER_SECTOR; slot++)
+    size_t n = 0;
+    uint32_t cur = r->cur_sector;
+    for (uint32_t k = 1; k <= r->sector_count; k++)
     {
-      record_flash_t *rf = (record_flash_t *) (sec_buf + SECTOR_HDR_SIZE +
-                                               (slot * RECORD_SIZE));
-
-      if (record_is_empty(rf) || !record_is_valid(rf))
+      uint32_t idx = (cur + k) % r->sector_count;
+      if (r->sectors[idx].seq_start == 0)
       {
+        continue;
+      }
+
+      uint32_t gen = atomic_load(&r->sync[idx].gen);
+      if (gen & 1)
+      {
+        continue;
+      }
+      out[n++] = (sector_info_t) {
+          .sector_idx = idx,
+          .seq_start = r->sectors[idx].seq_start,
+          .ts_start = r->sectors[idx].ts_start,
+          .gen = gen,
+          .verified = atomic_load(&r->sync[idx].verified_gen) == gen};
+    }
+    *last_seq = r->last_seq;
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&r->index_seq, memory_order_relaxed) == begin)
+      return n;
+  }
+}
+
+// First sector (in ring order) that may hold a record with timestamp >=
+// since_ts. A sector can be skipped when the next one's ts_start is already
+// older than since_ts, and ts_start never decreases along the ring, so this is
+// a binary search over the snapshot.
+static size_t seek_sector_by_ts(const sector_info_t *sectors, size_t n,
+                                uint32_t since_ts)
+{
+  size_t lo = 0;
+  size_t hi = (n > 0) ? n - 1 : 0;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (sectors[mid + 1].ts_start >= since_ts)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+static void ring_reset_state(ring_t *r)
+{
+  r->spare = NO_SPARE;
+  r->cur_sector = 0;
+  r->cur_off = SECTOR_HDR_SIZE;
+  memset(&r->enc, 0, sizeof(r->enc));
+  r->last_seq = 0;
+  r->ts_hwm = 0;
+}
+
+static void note_erase_us(ring_t *r, uint32_t sector_idx, uint32_t us,
+                          bool inline_erase)
+{
+  note_wear(r, sector_idx);
+  s_stats.erase_hist[latency_bucket(us)]++;
+  s_stats.erase_count++;
+  if (inline_erase)
+    s_stats.erase_inline++;
+  s_stats.erase_last_us = us;
+  if (us > s_stats.erase_max_us)
+    s_stats.erase_max_us = us;
+  s_stats.erase_total_us += us;
+}
+
+static void note_erase(ring_t *r, uint32_t sector_idx, int64_t t0,
+                       bool inline_erase)
+{
+  note_erase_us(r, sector_idx, (uint32_t) (esp_timer_get_time() - t0),
+                inline_erase);
+}
+
+static esp_err_t advance_sector(ring_t *r)
+{
+  uint32_t next = (r->cur_sector + 1) % r->sector_count;
+
+  // Drop the sector from the index before its contents go away
+  index_begin(r);
+  sector_retire(r, next);
+  index_end(r);
+
+  if (r->spare != next)
+  {
+    // No spare prepared: this write has to wait for the erase
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err =
+        esp_partition_erase_range(s_part, sector_offset(r, next), SECTOR_SIZE);
+    if (err != ESP_OK)
+      return err;
+    note_erase(r, next, t0, true);
+  }
+  r->spare = NO_SPARE;
+
+  esp_err_t err = write_sector_hdr(r, next, r->last_seq + 1, r->ts_hwm);
+  if (err != ESP_OK)
+    return err;
+
+  index_begin(r);
+  sector_publish(r, next, r->last_seq + 1, r->ts_hwm);
+  r->cur_sector = next;
+  index_end(r);
+
+  r->cur_off = SECTOR_HDR_SIZE;
+  memset(&r->enc, 0, sizeof(r->enc));
+  return ESP_OK;
+}
+
+// Replay the active sector to find the write position and, for the raw ring,
+// the encoder state to continue from.
+static void scan_current_sector_tail(ring_t *r)
+{
+  r->cur_off = SECTOR_SIZE;
+  memset(&r->enc, 0, sizeof(r->enc));
+
+  uint8_t *sec_buf;
+  if (!sector_buf_alloc(&sec_buf))
+  {
+    return;
+  }
+
+  const uint8_t *sector = sector_view(r, r->cur_sector, sec_buf);
+  if (!sector)
+  {
+    free(sec_buf);
+    return;
+  }
+
+  sector_cursor_t cur;
+  cursor_init(&cur, r->kind, sector, true);
+
+  for (;;)
+  {
+    ring_item_t it;
+    cursor_res_t res = cursor_next(&cur, &it);
+
+    if (res == CURSOR_END)
+    {
+      r->cur_off = ALIGN_UP(cur.off, FRAME_ALIGN);
+      r->enc = cur.st;
+      break;
+    }
+
+    if (res == CURSOR_CORRUPT)
+    {
+      // Torn write: keep what was readable and seal the sector
+      break;
+    }
+
+    r->last_seq++;
+    uint32_t ts = item_timestamp(r, &it);
+    if (ts > r->ts_hwm)
+    {
+      r->ts_hwm = ts;
+    }
+  }
+
+  free(sec_buf);
+}
+
+static bool sector_is_erased(const ring_t *r, uint32_t sector_idx)
+{
+  uint8_t *buf;
+  if (!sector_buf_alloc(&buf))
+    return false;
+
+  const uint8_t *sector = sector_view(r, sector_idx, buf);
+  bool erased = (sector != NULL);
+  for (size_t i = 0; erased && i < SECTOR_SIZE; i++)
+  {
+    erased = (sector[i] == 0xFF);
+  }
+
+  free(buf);
+  return erased;
+}
+
+// Sectors are written in ring order with increasing seq_start. Starting from
+// the first sector with a valid header, "valid and seq_start >= its
+// seq_start" therefore holds up to the write head and nowhere after it (only
+// older, blank or spare sectors follow), so the head is found by binary
+// search in O(log n) header reads.
+static bool locate_head(const ring_t *r, uint32_t *out_idx,
+                        sector_hdr_t *out_hdr)
+{
+  // Usually sector 0, or 1 when sector 0 is the spare; only a blank region
+  // costs a full pass
+  uint32_t lo = 0;
+  while (lo < r->sector_count && !read_sector_hdr(r, lo, out_hdr))
+  {
+    lo++;
+  }
+  if (lo == r->sector_count)
+    return false;
+
+  uint32_t ref_seq = out_hdr->seq_start;
+  uint32_t hi = r->sector_count - 1;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    sector_hdr_t hdr;
+    if (read_sector_hdr(r, mid, &hdr) && hdr.seq_start >= ref_seq)
+    {
+      lo = mid;
+      *out_hdr = hdr;
+    }
+    else
+    {
+      hi = mid - 1;
+    }
+  }
+
+  *out_idx = lo;
+  return true;
+}
+
+// Locate the write head of a ring, or start a fresh log in its first sector.
+// Only the head enters the index here; ring_load_index() adds the rest.
+// Caller holds s_lock.
+static esp_err_t ring_recover(ring_t *r)
+{
+  sector_hdr_t best;
+  uint32_t best_sector = 0;
+  bool found_any = locate_head(r, &best_sector, &best);
+
+  memset(r->sectors, 0, r->sector_count * sizeof(sector_meta_t));
+  ring_reset_state(r);
+
+  if (!found_any)
+  {
+    ESP_LOGI(TAG, "No valid %s log (format v%u); initializing its first sector",
+             r->name, (unsigned) FORMAT_VERSION);
+
+    r->bytes_boot = r->bytes_written;
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err =
+        esp_partition_erase_range(s_part, sector_offset(r, 0), SECTOR_SIZE);
+    if (err != ESP_OK)
+      return err;
+    note_erase(r, 0, t0, true);
+    err = write_sector_hdr(r, 0, 1, 0);
+    if (err != ESP_OK)
+      return err;
+    r->sectors[0] = (sector_meta_t) {.seq_start = 1, .ts_start = 0};
+    return ESP_OK;
+  }
+
+  r->sectors[best_sector] = (sector_meta_t) {.seq_start = best.seq_start,
+                                             .ts_start = best.ts_start};
+  r->cur_sector = best_sector;
+  r->last_seq = best.seq_start - 1;
+  r->ts_hwm = best.ts_start;
+  r->erases[best_sector] = best.erase_count;
+  scan_current_sector_tail(r);
+  r->bytes_written = best.bytes_written + r->cur_off;
+  r->bytes_boot = r->bytes_written;
+
+  // Keep a spare erased before the previous reset instead of erasing it again
+  uint32_t next = (r->cur_sector + 1) % r->sector_count;
+  if (sector_is_erased(r, next))
+  {
+    r->spare = next;
+  }
+
+  if (r->cur_off >= SECTOR_SIZE)
+  {
+    return advance_sector(r);
+  }
+  return ESP_OK;
+}
+
+// Add the headers of every sector besides the write head to the index. Runs
+// on the writer task after boot; until it is done, queries only see the
+// newest sector.
+static void ring_load_index(ring_t *r)
+{
+  uint32_t head_seq = r->sectors[r->cur_sector].seq_start;
+  uint32_t loaded = 0;
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  for (uint32_t k = 1; k < r->sector_count; k++)
+  {
+    uint32_t idx = (r->cur_sector + k) % r->sector_count;
+    sector_hdr_t hdr;
+    if (idx == r->spare || !read_sector_hdr(r, idx, &hdr))
+      continue;
+
+    // Anything newer than the head can only be a leftover from a corrupted
+    // header sequence; it will be overwritten in turn
+    if (hdr.seq_start >= head_seq)
+    {
+      ESP_LOGW(TAG, "%s sector %" PRIu32 " ahead of write head, ignored",
+               r->name, idx);
+      continue;
+    }
+
+    index_begin(r);
+    sector_publish(r, idx, hdr.seq_start, hdr.ts_start);
+    index_end(r);
+    r->erases[idx] = hdr.erase_count;
+    loaded++;
+  }
+  xSemaphoreGive(s_lock);
+
+  ESP_LOGI(TAG, "Index %s: %" PRIu32 " sealed sectors", r->name, loaded);
+}
+
+// Write one frame at the write head; padding it to the ECC unit size keeps
+// it a single aligned write phase for Flash ECC compliance.
+static esp_err_t ring_write_frame(ring_t *r, uint8_t *frame, size_t len,
+                                  uint32_t timestamp)
+{
+  size_t wlen = ALIGN_UP(len, FRAME_ALIGN);
+  memset(frame + len, FRAME_PADDING, wlen - len);
+
+  esp_err_t err =
+      ring_program(r, sector_offset(r, r->cur_sector) + r->cur_off, frame, wlen);
+  if (err != ESP_OK)
+  {
+    // The units may be partially programmed; never write them again
+    r->cur_off = SECTOR_SIZE;
+    return err;
+  }
+
+  r->cur_off += wlen;
+  index_begin(r);
+  r->last_seq++;
+  index_end(r);
+  if (timestamp > r->ts_hwm)
+    r->ts_hwm = timestamp;
+  return ESP_OK;
+}
+
+static bool ring_fits(const ring_t *r, size_t len)
+{
+  return r->cur_off + ALIGN_UP(len, FRAME_ALIGN) <= SECTOR_SIZE;
+}
+
+// Encode as many records of recs[] as fit in the active sector and write them
+// with a single aligned write. Returns the number of records written (0 when
+// the sector is full or on error, see *err).
+static size_t write_records(const record_ram_t *recs, size_t count,
+                            esp_err_t *err)
+{
+  static uint8_t batch[(RAM_BUFFER_RECORDS * FRAME_MAX_SIZE) + FRAME_ALIGN];
+
+  size_t room = SECTOR_SIZE - s_raw.cur_off;
+  codec_state_t st = s_raw.enc;
+  uint32_t ts_max = s_raw.ts_hwm;
+  size_t used = 0;
+  size_t n = 0;
+
+  *err = ESP_OK;
+  while (n < count && n < RAM_BUFFER_RECORDS)
+  {
+    codec_state_t next = st;
+    size_t len = encode_record(&next, recs[n].timestamp, recs[n].temps_cC,
+                               batch + used);
+    if (ALIGN_UP(used + len, FRAME_ALIGN) > room)
+      break;
+
+    st = next;
+    used += len;
+    if (recs[n].timestamp > ts_max)
+      ts_max = recs[n].timestamp;
+    n++;
+  }
+
+  if (n == 0)
+    return 0;
+
+  // Pad to the ECC unit size: the write is a single aligned program phase
+  size_t wlen = ALIGN_UP(used, FRAME_ALIGN);
+  memset(batch + used, FRAME_PADDING, wlen - used);
+
+  *err = ring_program(&s_raw,
+                      sector_offset(&s_raw, s_raw.cur_sector) + s_raw.cur_off,
+                      batch, wlen);
+  if (*err != ESP_OK)
+  {
+    // The units may be partially programmed; never write them again
+    s_raw.cur_off = SECTOR_SIZE;
+    return 0;
+  }
+
+  s_raw.cur_off += wlen;
+  index_begin(&s_raw);
+  s_raw.last_seq += (uint32_t) n;
+  index_end(&s_raw);
+  s_raw.ts_hwm = ts_max;
+  s_raw.enc = st;
+  return n;
+}
+
+static esp_err_t write_rollup(ring_t *r, const ntc_rollup_t *row)
+{
+  uint8_t frame[ALIGN_UP(ROLLUP_FRAME_SIZE, FRAME_ALIGN)];
+  size_t len = encode_rollup(row, frame);
+
+  if (!ring_fits(r, len))
+  {
+    esp_err_t err = advance_sector(r);
+    if (err != ESP_OK)
+      return err;
+  }
+
+  return ring_write_frame(r, frame, len, row->timestamp);
+}
+
+static void rollup_acc_reset(rollup_acc_t *acc, uint32_t bucket_start)
+{
+  memset(acc, 0, sizeof(*acc));
+  acc->bucket_start = bucket_start;
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    acc->min_cC[ch] = INT16_MAX;
+    acc->max_cC[ch] = INT16_MIN;
+  }
+}
+
+static void rollup_acc_to_row(const rollup_acc_t *acc, ntc_rollup_t *row)
+{
+  row->timestamp = acc->bucket_start;
+  row->count = acc->count;
+  row->raw_seq = acc->raw_seq;
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    if (acc->valid[ch] == 0)
+    {
+      // Same sentinel as an invalid raw sample
+      row->min_cC[ch] = INT16_MIN;
+      row->max_cC[ch] = INT16_MIN;
+      row->mean_cC[ch] = INT16_MIN;
+      continue;
+    }
+    row->min_cC[ch] = acc->min_cC[ch];
+    row->max_cC[ch] = acc->max_cC[ch];
+    row->mean_cC[ch] = (int16_t) lroundf((float) acc->sum[ch] / (float) acc->valid[ch]);
+  }
+}
+
+// Fold one raw sample, at log position seq, into a tier, writing out the bucket it closes.
+// Caller must hold s_lock!
+static void rollup_feed_tier_locked(int tier, uint32_t seq, uint32_t timestamp,
+                                    const int16_t temps_cC[NTC_CHANNELS_COUNT])
+{
+  ring_t *r = &s_tiers[tier];
+  rollup_acc_t *acc = &s_acc[tier];
+  if (r->sector_count == 0)
+    return;
+
+  uint32_t bucket = timestamp - (timestamp % s_tier_interval[tier]);
+  if (acc->count > 0 && bucket != acc->bucket_start)
+  {
+    ntc_rollup_t row;
+    rollup_acc_to_row(acc, &row);
+    esp_err_t err = write_rollup(r, &row);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "write_rollup(%s) failed: %s", r->name,
+               esp_err_to_name(err));
+    }
+    acc->count = 0;
+  }
+
+  if (acc->count == 0)
+  {
+    rollup_acc_reset(acc, bucket);
+  }
+
+  acc->raw_seq = seq;
+  if (acc->count < UINT16_MAX)
+    acc->count++;
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    int16_t v = temps_cC[ch];
+    if (v == INT16_MIN)
+      continue;
+    acc->valid[ch]++;
+    acc->sum[ch] += v;
+    if (v < acc->min_cC[ch])
+      acc->min_cC[ch] = v;
+    if (v > acc->max_cC[ch])
+      acc->max_cC[ch] = v;
+  }
+}
+
+// Caller must hold s_lock!
+static void rollup_feed_locked(uint32_t seq, uint32_t timestamp,
+                               const int16_t temps_cC[NTC_CHANNELS_COUNT])
+{
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
+  {
+    rollup_feed_tier_locked(t, seq, timestamp, temps_cC);
+  }
+}
+
+// Caller must hold s_lock!
+static void rtc_buf_seal(void)
+{
+  s_rtc.magic = RTC_BUF_MAGIC;
+  s_rtc.base_seq = s_raw.last_seq;
+  s_rtc.crc32 = crc32_le(&s_rtc, offsetof(rtc_buf_t, crc32));
+}
+
+// Take over samples buffered before a reset. Caller must hold s_lock!
+static uint32_t rtc_buf_restore(void)
+{
+  if (s_rtc.magic != RTC_BUF_MAGIC || s_rtc.count > RAM_BUFFER_RECORDS ||
+      crc32_le(&s_rtc, offsetof(rtc_buf_t, crc32)) != s_rtc.crc32)
+  {
+    // Power-on: RTC memory holds garbage
+    s_rtc.count = 0;
+    rtc_buf_seal();
+    return 0;
+  }
+
+  // Records flushed right before the reset are already on flash
+  uint32_t done = 0;
+  if (s_raw.last_seq > s_rtc.base_seq)
+  {
+    done = s_raw.last_seq - s_rtc.base_seq;
+    if (done > s_rtc.count)
+      done = s_rtc.count;
+  }
+
+  s_rtc.count -= done;
+  memmove(s_rtc.recs, &s_rtc.recs[done], s_rtc.count * sizeof(record_ram_t));
+  rtc_buf_seal();
+  return s_rtc.count;
+}
+
+// Caller must hold s_lock!
+static void flush_locked(void)
+{
+  size_t i = 0;
+  while (i < s_rtc.count)
+  {
+    esp_err_t err;
+    size_t n = write_records(&s_rtc.recs[i], s_rtc.count - i, &err);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "write_records failed: %s", esp_err_to_name(err));
+      break;
+    }
+
+    if (n == 0)
+    {
+      // Sector full: the rest goes to the next one, starting a new delta
+      // chain with a keyframe
+      err = advance_sector(&s_raw);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "advance_sector failed: %s", esp_err_to_name(err));
+        break;
+      }
+      continue;
+    }
+
+    i += n;
+  }
+
+  // If writes fail mid-way, shift remaining to front instead of dropping
+  if (i > 0)
+  {
+    size_t remaining = s_rtc.count - i;
+    if (remaining > 0)
+    {
+      memmove(s_rtc.recs, &s_rtc.recs[i], remaining * sizeof(record_ram_t));
+    }
+    s_rtc.count = (uint32_t) remaining;
+    rtc_buf_seal();
+  }
+}
+
+// Returns the seq the record will have on flash, or 0 if it was dropped.
+// Caller must hold s_lock!
+static uint32_t buffer_record_locked(const record_ram_t *rec)
+{
+  uint32_t seq = 0;
+
+  if (s_rtc.count >= RAM_BUFFER_RECORDS)
+  {
+    flush_locked();
+  }
+
+  if (s_rtc.count < RAM_BUFFER_RECORDS)
+  {
+    // Flushes write the buffer in order, so its position gives the seq
+    s_rtc.recs[s_rtc.count++] = *rec;
+    rtc_buf_seal();
+    seq = s_raw.last_seq + s_rtc.count;
+  }
+
+  // Rollups are fed at sample time; a bucket is written as soon as it
+  // closes. A dropped sample is still folded in, under the newest seq.
+  rollup_feed_locked(s_raw.last_seq + s_rtc.count, rec->timestamp,
+                     rec->temps_cC);
+
+  if (s_rtc.count >= RAM_BUFFER_RECORDS)
+  {
+    flush_locked();
+  }
+  return seq;
+}
+
+// Caller must hold s_lock!
+static size_t capacity_locked(void)
+{
+  // Records per sector depend on how well deltas compress, so use the sealed
+  // sectors (whose successor is known) as the estimate when there are any.
+  uint64_t sealed_records = 0;
+  uint32_t sealed = 0;
+  for (uint32_t i = 0; i < s_raw.sector_count; i++)
+  {
+    uint32_t next = (i + 1) % s_raw.sector_count;
+    if (i == s_raw.cur_sector || s_raw.sectors[i].seq_start == 0 ||
+        s_raw.sectors[next].seq_start == 0)
+    {
+      continue;
+    }
+    sealed_records += s_raw.sectors[next].seq_start - s_raw.sectors[i].seq_start;
+    sealed++;
+  }
+
+  // One sector is always kept erased ahead of the write head
+  uint32_t usable = (s_raw.sector_count > 1) ? s_raw.sector_count - 1 : 1;
+  if (sealed == 0)
+  {
+    return (size_t) usable * (SECTOR_DATA_SIZE / NOMINAL_RECORD_BYTES);
+  }
+  return (size_t) ((sealed_records * usable) / sealed);
+}
+
+// Caller must hold s_lock!
+static void wear_stats_locked(ntc_history_stats_t *out)
+{
+  ring_t *rings[1 + NTC_HISTORY_TIERS] = {&s_raw, &s_tiers[0], &s_tiers[1]};
+  double uptime_s = (double) esp_timer_get_time() / 1e6;
+  double days_left = -1.0;
+
+  out->wear_min = UINT32_MAX;
+  out->wear_max = 0;
+  for (size_t i = 0; i < 1 + NTC_HISTORY_TIERS; i++)
+  {
+    const ring_t *r = rings[i];
+    uint32_t ring_max = 0;
+    for (uint32_t k = 0; k < r->sector_count; k++)
+    {
+      uint32_t n = sector_erases(r, k);
+      if (n > ring_max)
+        ring_max = n;
+      if (n < out->wear_min)
+        out->wear_min = n;
+    }
+    if (ring_max > out->wear_max)
+      out->wear_max = ring_max;
+
+    out->bytes_written += r->bytes_written;
+    uint64_t boot_bytes = r->bytes_written - r->bytes_boot;
+    out->bytes_boot += boot_bytes;
+
+    if (ring_max >= NTC_HISTORY_ENDURANCE_CYCLES)
+    {
+      days_left = 0.0;
+      continue;
+    }
+    if (boot_bytes == 0 || uptime_s <= 0.0)
+      continue;
+    // One pass over the region costs every sector one erase
+    double cycles_per_day = (double) boot_bytes * 86400.0 /
+                            (uptime_s * r->sector_count * SECTOR_SIZE);
+    double days = (NTC_HISTORY_ENDURANCE_CYCLES - ring_max) / cycles_per_day;
+    if (days_left < 0.0 || days < days_left)
+      days_left = days;
+  }
+
+  if (out->wear_min == UINT32_MAX)
+    out->wear_min = 0;
+  out->wear_days_left = (days_left < 0.0 || days_left >= (double) UINT32_MAX)
+                            ? UINT32_MAX
+                            : (uint32_t) days_left;
+}
+
+void ntc_history_get_stats(ntc_history_stats_t *out)
+{
+  if (!out)
+    return;
+
+  memset(out, 0, sizeof(*out));
+  if (!s_lock)
+    return;
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *out = s_stats;
+  out->buffered = s_rtc.count;
+  wear_stats_locked(out);
+  xSemaphoreGive(s_lock);
+
+  out->crc_failures = atomic_load(&s_crc_failures);
+
+  out->queue_size = WRITER_QUEUE_LEN;
+  out->queue_depth = s_queue ? (uint32_t) uxQueueMessagesWaiting(s_queue) : 0;
+  out->queue_max = s_queue_max;
+  out->dropped = s_dropped;
+}
+
+typedef struct
+{
+  sector_info_t *sectors;   // ring order, oldest -> newest
+  size_t nsec;
+  uint32_t last_seq;        // newest flushed record at snapshot time
+} snapshot_t;
+
+static bool take_snapshot(const ring_t *r, snapshot_t *snap)
+{
+  // Dynamically allocate to avoid truncating partitions larger than 512KB
+  snap->sectors = malloc(r->sector_count * sizeof(sector_info_t));
+  if (!snap->sectors)
+  {
+    return false;
+  }
+
+  snap->nsec = snapshot_sectors(r, snap->sectors, &snap->last_seq);
+  return true;
+}
+
+// Number of records a sector of the snapshot holds, derived from the
+// sequence numbers alone (no flash access).
+static uint32_t snapshot_sector_records(const snapshot_t *snap, size_t si)
+{
+  uint32_t end = (si + 1 < snap->nsec) ? snap->sectors[si + 1].seq_start
+                                       : snap->last_seq + 1;
+  uint32_t n = end - snap->sectors[si].seq_start;
+  return (n > MAX_RECORDS_PER_SECTOR) ? MAX_RECORDS_PER_SECTOR : n;
+}
+
+typedef enum
+{
+  VISIT_SKIP,   // filtered out
+  VISIT_EMIT,   // handed to the callback
+  VISIT_STOP,   // callback asked to stop
+} visit_t;
+
+// Filter and callback shared by the walks over either kind of ring
+typedef struct
+{
+  const ring_t *ring;
+  uint32_t since_ts;
+  uint32_t until_ts;              // exclusive, 0 disables; forward walks only
+  ntc_history_iter_cb_t rec_cb;   // RING_RAW
+  ntc_rollup_iter_cb_t row_cb;    // RING_ROLLUP
+  void *ctx;
+} visitor_t;
+
+static visit_t visit_item(const visitor_t *v, const ring_item_t *it)
+{
+  uint32_t ts = item_timestamp(v->ring, it);
+  if (v->since_ts != 0 && ts < v->since_ts)
+    return VISIT_SKIP;
+  if (v->until_ts != 0 && ts >= v->until_ts)
+    return VISIT_STOP;
+
+  bool more = true;
+  if (v->ring->kind == RING_RAW)
+  {
+    if (v->rec_cb)
+      more = v->rec_cb(&it->rec, v->ctx);
+  }
+  else if (v->row_cb)
+  {
+    more = v->row_cb(&it->row, v->ctx);
+  }
+  return more ? VISIT_EMIT : VISIT_STOP;
+}
+
+// Record that every frame of a sealed snapshot sector passed its CRC, unless
+// the sector was recycled since the snapshot was taken.
+static void mark_verified(const ring_t *r, const snapshot_t *snap, size_t si)
+{
+  const sector_info_t *info = &snap->sectors[si];
+  if (info->verified || si + 1 >= snap->nsec || !sector_unchanged(r, info))
+    return;
+
+  // A stale store after the sector is recycled never matches its new
+  // generation, so no lock is needed
+  atomic_store(&r->sync[info->sector_idx].verified_gen, info->gen);
+}
+
+// Stream records oldest -> newest starting at record first_rec of snapshot
+// sector first_si.
+static size_t stream_forward(const snapshot_t *snap, size_t first_si,
+                             uint32_t first_rec, size_t max,
+                             const visitor_t *v)
+{
+  size_t emitted = 0;
+
+  // Frames are decoded in place from the mapped partition; whole sectors are
+  // only copied when it could not be mapped
+  uint8_t *sec_buf;
+  if (!sector_buf_alloc(&sec_buf))
+  {
+    return 0;
+  }
+
+  for (size_t si = first_si; si < snap->nsec; si++)
+  {
+    uint32_t first = (si == first_si) ? first_rec : 0;
+    uint32_t end = snapshot_sector_records(snap, si);
+    if (first >= end)
+      continue;
+
+    const uint8_t *sector =
+        sector_view(v->ring, snap->sectors[si].sector_idx, sec_buf);
+    if (!sector)
+      continue;
+
+    sector_cursor_t cur;
+    cursor_init(&cur, v->ring->kind, sector, !snap->sectors[si].verified);
+
+    for (uint32_t i = 0; i < end; i++)
+    {
+      ring_item_t it;
+      if (cursor_next(&cur, &it) != CURSOR_RECORD)
+      {
+        break;
+      }
+
+      // Whatever was decoded from a recycled sector is garbage
+      if (!sector_unchanged(v->ring, &snap->sectors[si]))
+        break;
+
+      if (i + 1 == end)
+        mark_verified(v->ring, snap, si);
+
+      // Deltas chain from the keyframe, so leading records are decoded
+      // but not emitted
+      if (i < first)
+        continue;
+
+      if (v->ring->kind == RING_RAW)
+        it.rec.seq = snap->sectors[si].seq_start + i;
+      visit_t res = visit_item(v, &it);
+      if (res == VISIT_STOP)
+        goto done;
+      if (res == VISIT_SKIP)
+        continue;
+
+      emitted++;
+      if (emitted >= max)
+        goto done;
+    }
+  }
+
+done:
+  free(sec_buf);
+  return emitted;
+}
+
+static size_t ring_iterate(const ring_t *r, uint32_t since_ts, size_t max,
+                           const visitor_t *v)
+{
+  if (max == 0)
+    max = (size_t) -1;
+
+  snapshot_t snap;
+  if (!take_snapshot(r, &snap))
+    return 0;
+
+  // Sectors entirely older than since_ts are never read
+  size_t first =
+      (since_ts != 0) ? seek_sector_by_ts(snap.sectors, snap.nsec, since_ts) : 0;
+
+  size_t emitted = stream_forward(&snap, first, 0, max, v);
+
+  free(snap.sectors);
+  return emitted;
+}
+
+typedef struct
+{
+  ntc_history_iter_cb_t cb;
+  void *ctx;
+  uint32_t last_seq;   // newest seq handed to cb
+  bool stopped;        // cb returned false
+} after_ctx_t;
+
+static bool after_cb(const ntc_record_t *rec, void *ctx)
+{
+  after_ctx_t *a = (after_ctx_t *) ctx;
+  a->last_seq = rec->seq;
+  a->stopped = !a->cb(rec, a->ctx);
+  return !a->stopped;
+}
+
+// Flash records after after_seq, from one snapshot. Returns false when cb
+// stopped or max was reached.
+static bool stream_after(after_ctx_t *a, uint32_t after_seq, size_t *left)
+{
+  snapshot_t snap;
+  if (!take_snapshot(&s_raw, &snap))
+    return false;
+
+  bool more = true;
+  if (snap.nsec > 0 && after_seq < snap.last_seq)
+  {
+    // Sectors hold consecutive seq ranges, oldest first: find the last one
+    // starting at or before the wanted record
+    uint32_t want = after_seq + 1;
+    size_t lo = 0;
+    size_t hi = snap.nsec - 1;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo + 1) / 2;
+      if (snap.sectors[mid].seq_start <= want)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+    // Older records than the cursor asks for are gone: start at the oldest
+    uint32_t first_rec = (snap.sectors[lo].seq_start <= want)
+                             ? want - snap.sectors[lo].seq_start
+                             : 0;
+
+    visitor_t v = {.ring = &s_raw, .rec_cb = after_cb, .ctx = a};
+    *left -= stream_forward(&snap, lo, first_rec, *left, &v);
+    more = (*left > 0) && !a->stopped;
+  }
+
+  free(snap.sectors);
+  return more;
+}
+
+typedef struct
+{
+  uint32_t after_seq[NTC_HISTORY_TIERS];  // newest raw seq each tier holds
+  uint32_t floor_ts[NTC_HISTORY_TIERS];   // same, for rows without a seq
+} catchup_ctx_t;
+
+static bool catchup_cb(const ntc_record_t *rec, void *ctx)
+{
+  catchup_ctx_t *c = (catchup_ctx_t *) ctx;
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
+  {
+    if (rec->seq > c->after_seq[t] && rec->timestamp >= c->floor_ts[t])
+      rollup_feed_tier_locked(t, rec->seq, rec->timestamp, rec->temps_cC);
+  }
+  xSemaphoreGive(s_lock);
+  return true;
+}
+
+static bool last_row_cb(const ntc_rollup_t *row, void *ctx)
+{
+  *(ntc_rollup_t *) ctx = *row;
+  return true;
+}
+
+// Newest row of a tier, from the last sector of its snapshot holding any
+static bool tier_last_row(const ring_t *r, ntc_rollup_t *row)
+{
+  snapshot_t snap;
+  if (!take_snapshot(r, &snap))
+    return false;
+
+  visitor_t v = {.ring = r, .row_cb = last_row_cb, .ctx = row};
+  bool found = false;
+  for (size_t si = snap.nsec; si-- > 0 && !found;)
+  {
+    if (snapshot_sector_records(&snap, si) != 0)
+      found = stream_forward(&snap, si, 0, (size_t) -1, &v) != 0;
+  }
+
+  free(snap.sectors);
+  return found;
+}
+
+// Rebuild the open bucket of every tier from the raw log, and write any
+// bucket that closed while the device was off (or that predates the tiers).
+// The clock restarts at each power-on, so the raw records a tier lacks are
+// found by seq, after the newest one its last row folded in.
+// Runs on the writer task before it takes queued samples, so nothing else
+// writes meanwhile.
+static void rollup_catch_up(void)
+{
+  catchup_ctx_t c;
+  uint32_t after = UINT32_MAX;
+
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
+  {
+    const ring_t *r = &s_tiers[t];
+    c.after_seq[t] = UINT32_MAX;
+    c.floor_ts[t] = 0;
+    if (r->sector_count == 0)
+      continue;
+
+    ntc_rollup_t row;
+    c.after_seq[t] = 0;
+    if (r->last_seq != 0 && tier_last_row(r, &row) && row.raw_seq != 0)
+    {
+      c.after_seq[t] = row.raw_seq;
+    }
+    else if (r->last_seq != 0)
+    {
+      // Rows from before the seq was stored: ts_hwm is the start of the
+      // newest written bucket
+      c.floor_ts[t] = r->ts_hwm + s_tier_interval[t];
+    }
+    if (c.after_seq[t] < after)
+      after = c.after_seq[t];
+  }
+
+  if (after == UINT32_MAX)
+    return;
+
+  after_ctx_t a = {.cb = catchup_cb, .ctx = &c, .last_seq = after};
+  size_t left = (size_t) -1;
+  stream_after(&a, after, &left);
+  ESP_LOGI(TAG, "Rollup catch-up replayed %u raw records",
+           (unsigned) ((size_t) -1 - left));
+}
+
+static esp_err_t rings_layout(void)
+{
+  uint32_t total = s_part->size / SECTOR_SIZE;
+  uint32_t tier_total = 0;
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
+  {
+    tier_total += s_tier_sectors[t];
+  }
+
+  // Raw samples need at least two sectors to rotate; give up on the tiers
+  // rather than on the raw log when the partition is too small.
+  if (total < 2 || total - 2 < tier_total)
+  {
+    ESP_LOGW(TAG, "Partition too small for rollup tiers (%" PRIu32 " sectors)",
+             total);
+    tier_total = 0;
+  }
+  if (total == 0)
+    return ESP_ERR_INVALID_SIZE;
+
+  s_raw.first_sector = 0;
+  s_raw.sector_count = total - tier_total;
+
+  // Tiers sit at the end of the partition so the raw log keeps its sectors
+  uint32_t next = s_raw.sector_count;
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
+  {
+    s_tiers[t].first_sector = next;
+    s_tiers[t].sector_count = (tier_total != 0) ? s_tier_sectors[t] : 0;
+    next += s_tiers[t].sector_count;
+  }
+
+  ring_t *rings[1 + NTC_HISTORY_TIERS] = {&s_raw, &s_tiers[0], &s_tiers[1]};
+  for (size_t i = 0; i < 1 + NTC_HISTORY_TIERS; i++)
+  {
+    if (rings[i]->sector_count == 0 || rings[i]->sectors)
+      continue;
+    rings[i]->sectors = calloc(rings[i]->sector_count, sizeof(sector_meta_t));
+    rings[i]->sync = calloc(rings[i]->sector_count, sizeof(sector_sync_t));
+    rings[i]->erases = calloc(rings[i]->sector_count, sizeof(uint32_t));
+    if (!rings[i]->sectors || !rings[i]->sync || !rings[i]->erases)
+      return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+// Erase the sector each ring will move to next, so that advance_sector()
+// only has to write a header. The index entry is dropped under the lock, but
+// the erase itself runs without it, so readers never wait on it.
+static void prepare_spares(void)
+{
+  ring_t *rings[1 + NTC_HISTORY_TIERS] = {&s_raw, &s_tiers[0], &s_tiers[1]};
+
+  for (size_t i = 0; i < 1 + NTC_HISTORY_TIERS; i++)
+  {
+    ring_t *r = rings[i];
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (r->sector_count < 2 || r->spare != NO_SPARE)
+    {
+      xSemaphoreGive(s_lock);
+      continue;
+    }
+    uint32_t next = (r->cur_sector + 1) % r->sector_count;
+    index_begin(r);
+    sector_retire(r, next);
+    index_end(r);
+    xSemaphoreGive(s_lock);
+
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err =
+        esp_partition_erase_range(s_part, sector_offset(r, next), SECTOR_SIZE);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "Spare erase (%s) failed: %s", r->name,
+               esp_err_to_name(err));
+    }
+    else
+    {
+      note_erase(r, next, t0, false);
+      // Only the writer task moves the write head, so next is still valid
+      // unless the log was wiped meanwhile
+      if ((r->cur_sector + 1) % r->sector_count == next)
+        r->spare = next;
+    }
+    xSemaphoreGive(s_lock);
+  }
+}
+
+static void writer_task(void *pvParameters)
+{
+  writer_msg_t msg;
+
+  // Not needed to accept samples, so kept off the boot path. Samples queued
+  // meanwhile are written afterwards, in order.
+  ring_load_index(&s_raw);
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
+  {
+    if (s_tiers[t].sector_count != 0)
+      ring_load_index(&s_tiers[t]);
+  }
+
+  // Samples restored from RTC memory go to flash first, so that the rollup
+  // catch-up sees them
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  flush_locked();
+  xSemaphoreGive(s_lock);
+
+  rollup_catch_up();
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  ESP_LOGI(TAG, "History ready: capacity~%u records",
+           (unsigned) capacity_locked());
+  xSemaphoreGive(s_lock);
+
+  while (1)
+  {
+    if (xQueueReceive(s_queue, &msg, portMAX_DELAY) != pdTRUE)
+      continue;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    uint32_t seq = 0;
+    if (msg.op == WRITER_RECORD)
+    {
+      seq = buffer_record_locked(&msg.rec);
+    }
+    else
+    {
+      flush_locked();
+    }
+
+    xSemaphoreGive(s_lock);
+
+    ntc_history_live_cb_t live = s_live_cb;
+    if (seq != 0 && live)
+    {
+      ntc_record_t rec = {.timestamp = msg.rec.timestamp, .seq = seq};
+      memcpy(rec.temps_cC, msg.rec.temps_cC, sizeof(rec.temps_cC));
+      live(&rec, s_live_ctx);
+    }
+
+    if (msg.op == WRITER_FLUSH)
+    {
+      xSemaphoreGive(msg.done);
+    }
+
+    // Erase ahead once the backlog is written
+    if (uxQueueMessagesWaiting(s_queue) == 0)
+    {
+      prepare_spares();
+    }
+  }
+}
+
+// Controlled restarts (esp_restart()) write out the queue and the buffer.
+// Runs on the restarting task, so the lock is only waited for briefly.
+static void shutdown_flush(void)
+{
+  if (!s_ready || xSemaphoreTake(s_lock, pdMS_TO_TICKS(SHUTDOWN_LOCK_MS)) != pdTRUE)
+    return;
+
+  writer_msg_t msg;
+  while (xQueueReceive(s_queue, &msg, 0) == pdTRUE)
+  {
+    if (msg.op == WRITER_RECORD)
+      buffer_record_locked(&msg.rec);
+    else
+      xSemaphoreGive(msg.done);
+  }
+  flush_locked();
+
+  xSemaphoreGive(s_lock);
+}
+
+void ntc_history_init(void)
+{
+  s_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                    STORAGE_PARTITION_SUBTYPE,
+                                    STORAGE_PARTITION_LABEL);
+  if (!s_part)
+  {
+    ESP_LOGE(TAG, "Could not find storage partition, will not log NTC history");
+    s_ready = false;
+    return;
+  }
+
+  if (s_part->erase_size != SECTOR_SIZE)
+  {
+    ESP_LOGE(TAG, "Unexpected erase size=%" PRIu32, s_part->erase_size);
+    s_ready = false;
+    return;
+  }
+
+  if (!s_map)
+  {
+    // Map once for the lifetime of the firmware; flash writes and erases
+    // keep the cache coherent with the mapping.
+    const void *map = NULL;
+    esp_err_t err = esp_partition_mmap(s_part, 0, s_part->size,
+                                       ESP_PARTITION_MMAP_DATA, &map,
+                                       &s_map_handle);
+    if (err == ESP_OK)
+    {
+      s_map = (const uint8_t *) map;
+    }
+    else
+    {
+      ESP_LOGW(TAG, "Could not map storage partition (%s), reading by copy",
+               esp_err_to_name(err));
+    }
+  }
+
+  esp_err_t err = rings_layout();
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Could not lay out history rings: %s", esp_err_to_name(err));
+    s_ready = false;
+    return;
+  }
+
+  if (!s_lock)
+  {
+    s_lock = xSemaphoreCreateMutex();
+  }
+
+  int64_t t0 = esp_timer_get_time();
+  s_hdr_reads = 0;
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+
+  ESP_ERROR_CHECK(ring_recover(&s_raw));
+  uint32_t restored = rtc_buf_restore();
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
+  {
+    memset(&s_acc[t], 0, sizeof(s_acc[t]));
+    if (s_tiers[t].sector_count != 0)
+    {
+      ESP_ERROR_CHECK(ring_recover(&s_tiers[t]));
+    }
+  }
+
+  xSemaphoreGive(s_lock);
+
+  int64_t boot_us = esp_timer_get_time() - t0;
+  uint32_t boot_reads = s_hdr_reads;
+
+  if (!s_queue)
+  {
+    s_queue = xQueueCreate(WRITER_QUEUE_LEN, sizeof(writer_msg_t));
+  }
+  if (s_queue && !s_writer &&
+      xTaskCreate(writer_task, "ntc_hist_wr", WRITER_TASK_STACK, NULL,
+                  WRITER_TASK_PRIO, &s_writer) != pdPASS)
+  {
+    s_writer = NULL;
+  }
+  if (!s_writer)
+  {
+    ESP_LOGE(TAG, "Could not start writer task, will not log NTC history");
+    return;
+  }
+
+  static bool shutdown_registered = false;
+  if (!shutdown_registered)
+  {
+    shutdown_registered =
+        (esp_register_shutdown_handler(shutdown_flush) == ESP_OK);
+  }
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+
+  s_ready = true;
+
+  ESP_LOGI(TAG,
+           "Init ok in %" PRId64 " us (%" PRIu32 " header reads): sectors=%" PRIu32
+           " cur_sector=%" PRIu32 " cur_off=%" PRIu32 " last_seq=%" PRIu32
+           " restored=%" PRIu32,
+           boot_us, boot_reads, s_raw.sector_count, s_raw.cur_sector,
+           s_raw.cur_off, s_raw.last_seq, restored);
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
+  {
+    ESP_LOGI(TAG,
+             "Rollup %s: interval=%" PRIu32 "s sectors=%" PRIu32
+             " last_seq=%" PRIu32,
+             s_tiers[t].name, s_tier_interval[t], s_tiers[t].sector_count,
+             s_tiers[t].last_seq);
+  }
+
+  xSemaphoreGive(s_lock);
+}
+
+void ntc_history_add_record(const float temps[NTC_CHANNELS_COUNT])
+{
+  if (!s_ready)
+    return;
+
+  writer_msg_t msg = {.op = WRITER_RECORD};
+  msg.rec.timestamp = (uint32_t) time(NULL);
+  for (int i = 0; i < NTC_CHANNELS_COUNT; i++)
+  {
+    msg.rec.temps_cC[i] = float_to_cC(temps[i]);
+  }
+
+  // Never block the caller on flash: a full queue means the writer has been
+  // stuck for a long time already
+  if (xQueueSend(s_queue, &msg, 0) != pdTRUE)
+  {
+    s_dropped++;
+    ESP_LOGW(TAG, "Writer queue full, sample dropped");
+    return;
+  }
+
+  uint32_t depth = (uint32_t) uxQueueMessagesWaiting(s_queue);
+  if (depth > s_queue_max)
+  {
+    s_queue_max = depth;
+  }
+}
+
+void ntc_history_set_latest(const float temps[NTC_CHANNELS_COUNT])
+{
+  ntc_latest_t l = {
+      .sweep = s_latest.sweep + 1,
+      .timestamp = (uint32_t) time(NULL),
+      .taken_us = esp_timer_get_time(),
+  };
+  for (int i = 0; i < NTC_CHANNELS_COUNT; i++)
+  {
+    bool valid = temps[i] != NTC_INVALID_TEMP && isfinite(temps[i]);
+    l.temps_cC[i] = valid ? float_to_cC(temps[i]) : INT16_MIN;
+    if (valid)
+      l.valid_mask |= 1u << i;
+  }
+
+  unsigned seq = atomic_load_explicit(&s_latest_seq, memory_order_relaxed);
+  atomic_store_explicit(&s_latest_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  s_latest = l;
+  atomic_store_explicit(&s_latest_seq, seq + 2, memory_order_release);
+}
+
+bool ntc_history_get_latest(ntc_latest_t *out)
+{
+  unsigned before;
+  unsigned after;
+  do
+  {
+    before = atomic_load_explicit(&s_latest_seq, memory_order_acquire);
+    *out = s_latest;
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&s_latest_seq, memory_order_relaxed);
+  } while ((before & 1) || before != after);
+
+  return out->sweep != 0;
+}
+
+void ntc_history_flush(void)
+{
+  if (!s_ready)
+    return;
+
+  // Goes through the queue so that samples sent before are flushed too
+  writer_msg_t msg = {.op = WRITER_FLUSH};
+  msg.done = xSemaphoreCreateBinary();
+  if (!msg.done)
+    return;
+
+  if (xQueueSend(s_queue, &msg, portMAX_DELAY) == pdTRUE)
+  {
+    xSemaphoreTake(msg.done, portMAX_DELAY);
+  }
+  vSemaphoreDelete(msg.done);
+}
+
+size_t ntc_history_get_capacity(void)
+{
+  if (!s_ready)
+    return 0;
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  size_t cap = capacity_locked();
+  xSemaphoreGive(s_lock);
+  return cap;
+}
+
+size_t ntc_history_iterate(uint32_t since_ts, size_t max,
+                           ntc_history_iter_cb_t cb, void *ctx)
+{
+  if (!s_ready)
+    return 0;
+
+  visitor_t v = {.ring = &s_raw, .since_ts = since_ts, .rec_cb = cb,
+                 .ctx = ctx};
+  return ring_iterate(&s_raw, since_ts, max, &v);
+}
+
+// Records of snapshot sector si older than until_ts. Decodes the sector.
+static uint32_t sector_records_before(const snapshot_t *snap, size_t si,
+                                      uint32_t until_ts)
+{
+  uint32_t n = snapshot_sector_records(snap, si);
+  uint8_t *sec_buf;
+  if (n == 0 || !sector_buf_alloc(&sec_buf))
+    return 0;
+
+  uint32_t before = 0;
+  const uint8_t *sector =
+      sector_view(&s_raw, snap->sectors[si].sector_idx, sec_buf);
+  if (sector)
+  {
+    sector_cursor_t cur;
+    cursor_init(&cur, RING_RAW, sector, !snap->sectors[si].verified);
+
+    ring_item_t it;
+    while (before < n && cursor_next(&cur, &it) == CURSOR_RECORD &&
+           it.rec.timestamp < until_ts)
+    {
+      before++;
+    }
+  }
+
+  free(sec_buf);
+  return before;
+}
+
+size_t ntc_history_iterate_range(uint32_t since_ts, uint32_t until_ts,
+                                 size_t max, ntc_history_iter_cb_t cb,
+                                 void *ctx)
+{
+  if (!s_ready)
+    return 0;
+
+  snapshot_t snap;
+  if (!take_snapshot(&s_raw, &snap))
+    return 0;
+
+  size_t first_si =
+      (since_ts != 0) ? seek_sector_by_ts(snap.sectors, snap.nsec, since_ts) : 0;
+  uint32_t first_rec = 0;
+
+  // Sectors after end_si - 1 start at or after until_ts and are never read
+  size_t end_si = snap.nsec;
+  if (until_ts != 0 && snap.nsec > 0)
+    end_si = seek_sector_by_ts(snap.sectors, snap.nsec, until_ts) + 1;
+
+  if (max != 0)
+  {
+    // Walk back from the end of the range using per-sector record counts
+    // until the newest max records are covered; only the sector holding
+    // until_ts is decoded here.
+    size_t needed = max;
+    for (size_t si = end_si; si-- > first_si;)
+    {
+      uint32_t n = (until_ts != 0 && si + 1 == end_si)
+                       ? sector_records_before(&snap, si, until_ts)
+                       : snapshot_sector_records(&snap, si);
+      if (n >= needed)
+      {
+        first_si = si;
+        first_rec = n - (uint32_t) needed;
         break;
       }
+      needed -= n;
+    }
+  }
+  else
+  {
+    max = (size_t) -1;
+  }
 
-      if (since_ts != 0 && rf->timestamp < since_ts)
-        continue;
+  visitor_t v = {.ring = &s_raw, .since_ts = since_ts, .until_ts = until_ts,
+                 .rec_cb = cb, .ctx = ctx};
+  size_t emitted = stream_forward(&snap, first_si, first_rec, max, &v);
+
+  free(snap.sectors);
+  return emitted;
+}
+
+size_t ntc_history_iterate_tail(uint32_t since_ts, size_t max,
+                                ntc_history_iter_cb_t cb, void *ctx)
+{
+  return ntc_history_iterate_range(since_ts, 0, max, cb, ctx);
+}
+
+size_t ntc_history_iterate_after(uint32_t after_seq, size_t max,
+                                 ntc_history_iter_cb_t cb, void *ctx)
+{
+  if (!s_ready)
+    return 0;
+  if (max == 0)
+    max = (size_t) -1;
+
+  after_ctx_t a = {.cb = cb, .ctx = ctx, .last_seq = after_seq};
+  size_t left = max;
+  if (!stream_after(&a, after_seq, &left))
+    return max - left;
+
+  // Then the samples still buffered in RAM. A flush may have moved some of
+  // them to flash after the snapshot, so walk the flash again until the
+  // buffer starts right after what was emitted.
+  record_ram_t buf[RAM_BUFFER_RECORDS];
+  uint32_t n = 0;
+  uint32_t base = 0;
+  for (int tries = 0; tries < 4; tries++)
+  {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    base = s_raw.last_seq;
+    n = s_rtc.count;
+    memcpy(buf, s_rtc.recs, n * sizeof(record_ram_t));
+    xSemaphoreGive(s_lock);
+
+    if (base <= a.last_seq)
+      break;
+    if (!stream_after(&a, a.last_seq, &left))
+      return max - left;
+    n = 0;
+  }
+
+  for (uint32_t k = 0; k < n && left > 0; k++)
+  {
+    uint32_t seq = base + 1 + k;
+    if (seq <= a.last_seq)
+      continue;
+
+    ntc_record_t rec = {.timestamp = buf[k].timestamp, .seq = seq};
+    memcpy(rec.temps_cC, buf[k].temps_cC, sizeof(rec.temps_cC));
+    left--;
+    if (!cb(&rec, ctx))
+      break;
+  }
+  return max - left;
+}
+
+void ntc_history_set_live_cb(ntc_history_live_cb_t cb, void *ctx)
+{
+  s_live_ctx = ctx;
+  s_live_cb = cb;
+}
+
+uint32_t ntc_history_last_seq(void)
+{
+  return s_ready ? s_raw.last_seq : 0;
+}
+
+uint32_t ntc_history_first_seq(void)
+{
+  snapshot_t snap;
+  if (!s_ready || !take_snapshot(&s_raw, &snap))
+    return 1;
+
+  uint32_t first = (snap.nsec > 0) ? snap.sectors[0].seq_start : snap.last_seq + 1;
+  free(snap.sectors);
+  return first;
+}
 
-      ntc_record_t r;
-      r.timestamp = rf->timestamp;
-      memcpy(r.temps_cC, rf->temps_cC, sizeof(r.temps_cC));
+// Records of one sector are emitted newest-first in chunks: a forward pass
+// remembers the cursor every REVERSE_CHUNK records, then each chunk is decoded
+// again from its checkpoint and emitted backwards.
+#define REVERSE_CHUNK 32u
 
-      if (cb && !cb(&r, ctx))
+typedef struct
+{
+  sector_cursor_t marks[(MAX_RECORDS_PER_SECTOR / REVERSE_CHUNK) + 1];
+  ring_item_t chunk[REVERSE_CHUNK];
+  uint8_t sector[];   // SECTOR_SIZE bounce buffer when the partition is not mapped
+} reverse_buf_t;
+
+size_t ntc_history_iterate_reverse(uint32_t since_ts, size_t max,
+                                   ntc_history_iter_cb_t cb, void *ctx)
+{
+  if (!s_ready)
+    return 0;
+  if (max == 0)
+    max = (size_t) -1;
+
+  snapshot_t snap;
+  if (!take_snapshot(&s_raw, &snap))
+    return 0;
+
+  size_t last_si =
+      (since_ts != 0) ? seek_sector_by_ts(snap.sectors, snap.nsec, since_ts) : 0;
+
+  visitor_t v = {.ring = &s_raw, .since_ts = since_ts, .rec_cb = cb,
+                 .ctx = ctx};
+  size_t emitted = 0;
+
+  reverse_buf_t *rb = malloc(sizeof(reverse_buf_t) + (s_map ? 0 : SECTOR_SIZE));
+  if (!rb)
+  {
+    free(snap.sectors);
+    return 0;
+  }
+
+  for (size_t si = snap.nsec; si-- > last_si;)
+  {
+    uint32_t n = snapshot_sector_records(&snap, si);
+    if (n == 0)
+      continue;
+
+    const uint8_t *sector =
+        sector_view(&s_raw, snap.sectors[si].sector_idx, rb->sector);
+    if (!sector)
+      continue;
+
+    // Only the trailing records that could still be emitted matter
+    uint32_t first = (max - emitted < n) ? n - (uint32_t) (max - emitted) : 0;
+
+    sector_cursor_t cur;
+    cursor_init(&cur, RING_RAW, sector, !snap.sectors[si].verified);
+
+    size_t nmarks = 0;
+    uint32_t valid = 0;
+    while (valid < n)
+    {
+      if (valid >= first && (valid - first) % REVERSE_CHUNK == 0)
       {
-        goto done;
+        rb->marks[nmarks++] = cur;
       }
 
-      emitted++;
-      if (emitted >= max)
-        goto done;
+      ring_item_t it;
+      if (cursor_next(&cur, &it) != CURSOR_RECORD)
+        break;
+      valid++;
+    }
+
+    if (valid == n)
+      mark_verified(&s_raw, &snap, si);
+
+    for (size_t m = nmarks; m-- > 0;)
+    {
+      uint32_t start = first + (uint32_t) m * REVERSE_CHUNK;
+      if (start >= valid)
+        continue;
+      uint32_t count = valid - start;
+      if (count > REVERSE_CHUNK)
+        count = REVERSE_CHUNK;
+
+      cur = rb->marks[m];
+      for (uint32_t k = 0; k < count; k++)
+      {
+        (void) cursor_next(&cur, &rb->chunk[k]);
+        rb->chunk[k].rec.seq = snap.sectors[si].seq_start + start + k;
+      }
+      if (!sector_unchanged(&s_raw, &snap.sectors[si]))
+        break;
+
+      for (uint32_t k = count; k-- > 0;)
+      {
+        visit_t res = visit_item(&v, &rb->chunk[k]);
+        if (res == VISIT_STOP)
+          goto done;
+        if (res == VISIT_SKIP)
+          continue;
+
+        emitted++;
+        if (emitted >= max)
+          goto done;
+      }
     }
   }
 
 done:
-  free(sec_buf);
-  free(sectors);
+  free(rb);
+  free(snap.sectors);
   return emitted;
 }
 
+uint32_t ntc_history_tier_interval(int tier)
+{
+  if (tier < 0 || tier >= NTC_HISTORY_TIERS)
+    return NTC_DELAY_SEC;
+  return s_tier_interval[tier];
+}
+
+size_t ntc_history_iterate_rollup(int tier, uint32_t since_ts, size_t max,
+                                  ntc_rollup_iter_cb_t cb, void *ctx)
+{
+  if (!s_ready || tier < 0 || tier >= NTC_HISTORY_TIERS ||
+      s_tiers[tier].sector_count == 0)
+  {
+    return 0;
+  }
+
+  // A bucket is kept when it overlaps [since_ts, ...)
+  uint32_t interval = s_tier_interval[tier];
+  uint32_t since_bucket =
+      (since_ts > interval) ? since_ts - (since_ts % interval) : 0;
+
+  visitor_t v = {.ring = &s_tiers[tier], .since_ts = since_bucket,
+                 .row_cb = cb, .ctx = ctx};
+  return ring_iterate(&s_tiers[tier], since_bucket, max, &v);
+}
+
+// Oldest timestamp a ring still covers, from its index
+static bool ring_oldest(const ring_t *r, uint32_t *out_ts)
+{
+  if (r->sector_count == 0)
+    return false;
+
+  snapshot_t snap;
+  if (!take_snapshot(r, &snap))
+    return false;
+
+  bool has = snap.nsec > 0 && snap.last_seq != 0;
+  if (has)
+    *out_ts = snap.sectors[0].ts_start;
+
+  free(snap.sectors);
+  return has;
+}
+
+int ntc_history_select_tier(uint32_t since_ts, uint32_t until_ts,
+                            size_t max_points)
+{
+  if (!s_ready)
+    return -1;
+
+  if (until_ts == 0)
+    until_ts = (uint32_t) time(NULL);
+  uint32_t span = (until_ts > since_ts) ? until_ts - since_ts : 0;
+
+  // Levels from finest (raw, -1) to coarsest
+  const ring_t *rings[1 + NTC_HISTORY_TIERS] = {&s_raw, &s_tiers[0], &s_tiers[1]};
+  bool has[1 + NTC_HISTORY_TIERS];
+  uint32_t oldest[1 + NTC_HISTORY_TIERS];
+  uint32_t data_oldest = UINT32_MAX;
+
+  for (int l = 0; l < 1 + NTC_HISTORY_TIERS; l++)
+  {
+    has[l] = ring_oldest(rings[l], &oldest[l]);
+    if (has[l] && oldest[l] < data_oldest)
+      data_oldest = oldest[l];
+  }
+
+  // Nothing older than the oldest stored sample can be shown at any level
+  uint32_t need = (since_ts > data_oldest) ? since_ts : data_oldest;
+  int coarsest = -1;
+
+  for (int l = 0; l < 1 + NTC_HISTORY_TIERS; l++)
+  {
+    if (!has[l])
+      continue;
+    coarsest = l - 1;
+
+    uint32_t interval = ntc_history_tier_interval(l - 1);
+    bool covers = oldest[l] <= need + interval;
+    bool fits = max_points == 0 || span / interval <= max_points;
+    if (covers && fits)
+      return l - 1;
+  }
+
+  return coarsest;
+}
+
+// Percentile histogram: 0.5 degC bins from -40 degC, edges clamp
+#define AGG_HIST_MIN_cC -4000
+#define AGG_HIST_BIN_cC 50
+#define AGG_HIST_BINS   256
+
 typedef struct
 {
-  size_t count;
-} count_ctx_t;
+  uint32_t since_ts;
+  uint32_t until_ts;
+  uint32_t bucket_seconds;
+  uint8_t percentile;
+  uint32_t *hist;      // [NTC_CHANNELS_COUNT][AGG_HIST_BINS], percentile only
+  int tier;            // rollup tier serving the range, or -1
+  uint32_t raw_from;   // first timestamp the rollups did not cover
+  ntc_aggregate_cb_t cb;
+  void *ctx;
+  size_t emitted;
+  bool stop;
+
+  bool open;
+  ntc_aggregate_t cur;
+  uint32_t valid[NTC_CHANNELS_COUNT];
+  int64_t sum[NTC_CHANNELS_COUNT];
+} agg_ctx_t;
+
+static int16_t agg_percentile(const agg_ctx_t *a, int ch)
+{
+  const uint32_t *bins = &a->hist[ch * AGG_HIST_BINS];
+  uint64_t target = ((uint64_t) a->valid[ch] * a->percentile + 99) / 100;
+  uint64_t seen = 0;
+  int b = 0;
+
+  if (target == 0)
+    target = 1;
+  for (; b < AGG_HIST_BINS - 1; b++)
+  {
+    seen += bins[b];
+    if (seen >= target)
+      break;
+  }
+
+  // Bin centre, kept within the exact extremes
+  int32_t v = AGG_HIST_MIN_cC + b * AGG_HIST_BIN_cC + AGG_HIST_BIN_cC / 2;
+  if (v < a->cur.min_cC[ch])
+    v = a->cur.min_cC[ch];
+  if (v > a->cur.max_cC[ch])
+    v = a->cur.max_cC[ch];
+  return (int16_t) v;
+}
+
+static void agg_emit(agg_ctx_t *a)
+{
+  if (!a->open)
+    return;
+  a->open = false;
+
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    a->cur.pct_cC[ch] = INT16_MIN;
+    if (a->valid[ch] == 0)
+    {
+      a->cur.min_cC[ch] = INT16_MIN;
+      a->cur.max_cC[ch] = INT16_MIN;
+      a->cur.mean_cC[ch] = INT16_MIN;
+      continue;
+    }
+    a->cur.mean_cC[ch] =
+        (int16_t) lroundf((float) a->sum[ch] / (float) a->valid[ch]);
+    if (a->hist)
+      a->cur.pct_cC[ch] = agg_percentile(a, ch);
+  }
+
+  a->emitted++;
+  if (!a->cb(&a->cur, a->ctx))
+    a->stop = true;
+}
+
+// Fold weight samples summarized by min/max/mean into the running bucket
+static bool agg_add(agg_ctx_t *a, uint32_t timestamp, uint32_t weight,
+                    const int16_t *min_cC, const int16_t *max_cC,
+                    const int16_t *mean_cC)
+{
+  if (a->until_ts != 0 && timestamp >= a->until_ts)
+    return false;
+
+  uint32_t bucket = a->since_ts;
+  if (a->bucket_seconds != 0)
+    bucket = timestamp - (timestamp % a->bucket_seconds);
+
+  if (a->open && bucket != a->cur.timestamp)
+  {
+    agg_emit(a);
+    if (a->stop)
+      return false;
+  }
+
+  if (!a->open)
+  {
+    a->open = true;
+    a->cur.timestamp = bucket;
+    a->cur.count = 0;
+    memset(a->valid, 0, sizeof(a->valid));
+    memset(a->sum, 0, sizeof(a->sum));
+    for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+    {
+      a->cur.min_cC[ch] = INT16_MAX;
+      a->cur.max_cC[ch] = INT16_MIN;
+    }
+    if (a->hist)
+      memset(a->hist, 0,
+             NTC_CHANNELS_COUNT * AGG_HIST_BINS * sizeof(a->hist[0]));
+  }
+
+  a->cur.count += weight;
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    if (mean_cC[ch] == INT16_MIN)
+      continue;
+    a->valid[ch] += weight;
+    a->sum[ch] += (int64_t) mean_cC[ch] * weight;
+    if (min_cC[ch] < a->cur.min_cC[ch])
+      a->cur.min_cC[ch] = min_cC[ch];
+    if (max_cC[ch] > a->cur.max_cC[ch])
+      a->cur.max_cC[ch] = max_cC[ch];
+
+    if (a->hist)
+    {
+      int32_t bin = (mean_cC[ch] - AGG_HIST_MIN_cC) / AGG_HIST_BIN_cC;
+      if (bin < 0)
+        bin = 0;
+      if (bin >= AGG_HIST_BINS)
+        bin = AGG_HIST_BINS - 1;
+      a->hist[ch * AGG_HIST_BINS + bin] += weight;
+    }
+  }
+  return true;
+}
+
+static bool agg_record_cb(const ntc_record_t *rec, void *ctx)
+{
+  agg_ctx_t *a = (agg_ctx_t *) ctx;
+  if (rec->timestamp < a->raw_from)
+    return true;
+  return agg_add(a, rec->timestamp, 1, rec->temps_cC, rec->temps_cC,
+                 rec->temps_cC);
+}
 
-static bool count_cb(const ntc_record_t *rec, void *ctx)
+static bool agg_row_cb(const ntc_rollup_t *row, void *ctx)
 {
-  (void) rec;
-  count_ctx_t *c = (count_ctx_t *) ctx;
-  c->count++;
+  agg_ctx_t *a = (agg_ctx_t *) ctx;
+  if (row->timestamp < a->since_ts)
+    return true;
+  if (!agg_add(a, row->timestamp, row->count, row->min_cC, row->max_cC,
+               row->mean_cC))
+    return false;
+  a->raw_from = row->timestamp + s_tier_interval[a->tier];
   return true;
 }
 
+// Coarsest tier whose rows tile the buckets exactly and reach back to the
+// range start, or -1
+static int aggregate_tier(uint32_t since_ts, uint32_t until_ts,
+                          uint32_t bucket_seconds)
+{
+  uint32_t raw_oldest = 0;
+  bool raw_has = ring_oldest(&s_raw, &raw_oldest);
+
+  for (int t = NTC_HISTORY_TIERS - 1; t >= 0; t--)
+  {
+    uint32_t interval = s_tier_interval[t];
+    if (bucket_seconds % interval != 0 || since_ts % interval != 0 ||
+        until_ts % interval != 0)
+    {
+      continue;
+    }
+
+    uint32_t oldest;
+    if (!ring_oldest(&s_tiers[t], &oldest))
+      continue;
+    // A tier that starts later than the raw log would miss samples
+    if (oldest <= since_ts || !raw_has || oldest <= raw_oldest)
+      return t;
+  }
+  return -1;
+}
+
+size_t ntc_history_aggregate(uint32_t since_ts, uint32_t until_ts,
+                             uint32_t bucket_seconds, uint8_t percentile,
+                             ntc_aggregate_cb_t cb, void *ctx)
+{
+  if (!s_ready || !cb || percentile > 100)
+    return 0;
+
+  agg_ctx_t *a = calloc(1, sizeof(*a));
+  if (!a)
+    return 0;
+  a->since_ts = since_ts;
+  a->until_ts = until_ts;
+  a->bucket_seconds = bucket_seconds;
+  a->percentile = percentile;
+  a->cb = cb;
+  a->ctx = ctx;
+  a->tier = -1;
+  a->raw_from = since_ts;
+
+  if (percentile != 0)
+  {
+    a->hist = malloc(NTC_CHANNELS_COUNT * AGG_HIST_BINS * sizeof(uint32_t));
+    if (!a->hist)
+    {
+      free(a);
+      return 0;
+    }
+  }
+  else if (bucket_seconds != 0)
+  {
+    // Closed rollup buckets first, then the raw records after the newest
+    a->tier = aggregate_tier(since_ts, until_ts, bucket_seconds);
+    if (a->tier >= 0)
+      ntc_history_iterate_rollup(a->tier, since_ts, 0, agg_row_cb, a);
+  }
+
+  if (!a->stop)
+  {
+    ntc_history_iterate(a->raw_from, 0, agg_record_cb, a);
+  }
+  if (!a->stop)
+  {
+    agg_emit(a);
+  }
+
+  size_t emitted = a->emitted;
+  free(a->hist);
+  free(a);
+  return emitted;
+}
+
 typedef struct
 {
   ntc_record_t *out;
   size_t max;
-  size_t skip;
   size_t written;
-  size_t seen;
-} copy_ctx_t;
+} fill_ctx_t;
 
-static bool copy_cb(const ntc_record_t *rec, void *ctx)
+// Fills the output array from its end, so reverse iteration lands
+// chronologically ordered.
+static bool fill_reverse_cb(const ntc_record_t *rec, void *ctx)
 {
-  copy_ctx_t *c = (copy_ctx_t *) ctx;
-
-  if (c->seen++ < c->skip)
-    return true;
-  if (c->written >= c->max)
-    return false;
+  fill_ctx_t *c = (fill_ctx_t *) ctx;
 
-  c->out[c->written++] = *rec;
+  c->out[c->max - 1 - c->written] = *rec;
+  c->written++;
   return c->written < c->max;
 }
 
@@ -586,52 +2838,111 @@ size_t ntc_history_get_records(ntc_record_t *out_records, size_t max_records)
   if (!s_ready || !out_records || max_records == 0)
     return 0;
 
-  count_ctx_t cc = {.count = 0};
-  (void) ntc_history_iterate(0, 0, count_cb, &cc);
-
-  size_t total = cc.count;
-  size_t skip = (total > max_records) ? (total - max_records) : 0;
-
-  copy_ctx_t cx = {
+  fill_ctx_t cx = {
       .out = out_records,
       .max = max_records,
-      .skip = skip,
       .written = 0,
-      .seen = 0,
   };
 
-  (void) ntc_history_iterate(0, 0, copy_cb, &cx);
+  (void) ntc_history_iterate_reverse(0, max_records, fill_reverse_cb, &cx);
+
+  if (cx.written < max_records)
+  {
+    memmove(out_records, &out_records[max_records - cx.written],
+            cx.written * sizeof(ntc_record_t));
+  }
   return cx.written;
 }
 
+// Caller must hold s_lock!
+static esp_err_t ring_format_locked(ring_t *r, uint32_t seq_start)
+{
+  if (r->sector_count == 0)
+    return ESP_OK;
+
+  esp_err_t err = write_sector_hdr(r, 0, seq_start, 0);
+  if (err != ESP_OK)
+    return err;
+
+  index_begin(r);
+  sector_publish(r, 0, seq_start, 0);
+  r->last_seq = seq_start - 1;
+  index_end(r);
+  return ESP_OK;
+}
+
 esp_err_t ntc_history_erase_all(void)
 {
-  if (!s_part)
+  if (!s_part || !s_raw.sectors)
     return ESP_ERR_INVALID_STATE;
   if (!s_lock)
     s_lock = xSemaphoreCreateMutex();
 
   xSemaphoreTake(s_lock, portMAX_DELAY);
 
+  // Record numbering carries on, so that sync cursors held by clients never
+  // match new records. RAM-buffered records were already numbered (and
+  // maybe streamed) even though they are dropped with the rest.
+  uint32_t next_seq = s_raw.last_seq + s_rtc.count + 1;
+
+  // Retire every sector first so that readers drop whatever they are walking
+  ring_t *rings[1 + NTC_HISTORY_TIERS] = {&s_raw, &s_tiers[0], &s_tiers[1]};
+  for (size_t i = 0; i < 1 + NTC_HISTORY_TIERS; i++)
+  {
+    index_begin(rings[i]);
+    for (uint32_t k = 0; k < rings[i]->sector_count; k++)
+    {
+      sector_retire(rings[i], k);
+      // Settle unknown wear counts while the write head is still known
+      rings[i]->erases[k] = sector_erases(rings[i], k);
+    }
+    ring_reset_state(rings[i]);
+    index_end(rings[i]);
+  }
+
+  int64_t t0 = esp_timer_get_time();
   esp_err_t err = esp_partition_erase_range(s_part, 0, s_part->size);
+  if (err == ESP_OK)
+  {
+    // One call for the whole partition: each sector gets an equal share
+    uint32_t sectors = 0;
+    for (size_t i = 0; i < 1 + NTC_HISTORY_TIERS; i++)
+    {
+      sectors += rings[i]->sector_count;
+    }
+    uint32_t us = (uint32_t) (esp_timer_get_time() - t0) / (sectors ? sectors : 1);
+    for (size_t i = 0; i < 1 + NTC_HISTORY_TIERS; i++)
+    {
+      for (uint32_t k = 0; k < rings[i]->sector_count; k++)
+      {
+        note_erase_us(rings[i], k, us, false);
+      }
+    }
+  }
+  if (err == ESP_OK)
+    err = ring_format_locked(&s_raw, next_seq);
+  for (int t = 0; t < NTC_HISTORY_TIERS && err == ESP_OK; t++)
+  {
+    err = ring_format_locked(&s_tiers[t], 1);
+    memset(&s_acc[t], 0, sizeof(s_acc[t]));
+  }
   if (err != ESP_OK)
   {
     xSemaphoreGive(s_lock);
     return err;
   }
 
-  err = write_sector_hdr(0, 1);
-  if (err != ESP_OK)
+  // The whole partition is blank, so every next sector is already a spare
+  if (s_raw.sector_count > 1)
+    s_raw.spare = 1;
+  for (int t = 0; t < NTC_HISTORY_TIERS; t++)
   {
-    xSemaphoreGive(s_lock);
-    return err;
+    if (s_tiers[t].sector_count > 1)
+      s_tiers[t].spare = 1;
   }
 
-  s_cur_sector = 0;
-  s_cur_slot = 0;
-  s_last_seq = 0;
-  s_ram_count = 0;
-  s_ready = true;
+  s_rtc.count = 0;
+  rtc_buf_seal();
 
   xSemaphoreGive(s_lock);
   return ESP_OK;
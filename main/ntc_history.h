@@ -21,6 +21,7 @@
 
 #include "esp_err.h"
 #include "ntc_sensor.h"
+#include "sdkconfig.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -30,23 +31,139 @@
 typedef struct
 {
   uint32_t timestamp;   // unix seconds
+  uint32_t seq;         // position in the log, from 1, never reused
   int16_t temps_cC[NTC_CHANNELS_COUNT];
 } ntc_record_t;
 
 typedef bool (*ntc_history_iter_cb_t)(const ntc_record_t *rec, void *ctx);
 
+// Rollup tiers from Kconfig (raw samples are level -1)
+#define NTC_HISTORY_TIERS              2
+#define NTC_HISTORY_TIER1_INTERVAL_SEC CONFIG_HISTORY_TIER1_INTERVAL_SEC
+#define NTC_HISTORY_TIER1_SECTORS      CONFIG_HISTORY_TIER1_SECTORS
+#define NTC_HISTORY_TIER2_INTERVAL_SEC CONFIG_HISTORY_TIER2_INTERVAL_SEC
+#define NTC_HISTORY_TIER2_SECTORS      CONFIG_HISTORY_TIER2_SECTORS
+
+#define NTC_HISTORY_ENDURANCE_CYCLES CONFIG_HISTORY_FLASH_ENDURANCE_CYCLES
+
+// Flash latency histograms: bucket i counts operations shorter than
+// NTC_HISTORY_LAT_BASE_US << (2 * i); the last bucket is open-ended.
+#define NTC_HISTORY_LAT_BUCKETS 8
+#define NTC_HISTORY_LAT_BASE_US 64
+
+typedef struct
+{
+  uint32_t timestamp;   // bucket start, unix seconds
+  uint16_t count;       // raw samples folded into the bucket
+  int16_t min_cC[NTC_CHANNELS_COUNT];    // INT16_MIN when no valid sample
+  int16_t max_cC[NTC_CHANNELS_COUNT];
+  int16_t mean_cC[NTC_CHANNELS_COUNT];
+  uint32_t raw_seq;     // newest raw sample folded in, 0 on older rows
+} ntc_rollup_t;
+
+typedef bool (*ntc_rollup_iter_cb_t)(const ntc_rollup_t *row, void *ctx);
+
+typedef struct
+{
+  uint32_t timestamp;   // bucket start, unix seconds
+  uint32_t count;       // samples folded into the bucket
+  int16_t min_cC[NTC_CHANNELS_COUNT];    // INT16_MIN when no valid sample
+  int16_t max_cC[NTC_CHANNELS_COUNT];
+  int16_t mean_cC[NTC_CHANNELS_COUNT];
+  int16_t pct_cC[NTC_CHANNELS_COUNT];    // INT16_MIN unless requested
+} ntc_aggregate_t;
+
+typedef bool (*ntc_aggregate_cb_t)(const ntc_aggregate_t *bucket, void *ctx);
+
+typedef struct
+{
+  uint32_t queue_size;       // writer queue length
+  uint32_t queue_depth;      // samples waiting for the writer task
+  uint32_t queue_max;        // high-water mark of queue_depth
+  uint32_t dropped;          // samples lost to a full queue
+  uint32_t buffered;         // samples held in RAM, not yet in flash
+  uint32_t erase_count;      // sector erases since boot
+  uint32_t erase_inline;     // erases a write had to wait for (no spare)
+  uint32_t erase_last_us;
+  uint32_t erase_max_us;
+  uint64_t erase_total_us;
+  uint32_t write_hist[NTC_HISTORY_LAT_BUCKETS];   // flash writes since boot
+  uint32_t erase_hist[NTC_HISTORY_LAT_BUCKETS];   // sector erases since boot
+  uint32_t crc_failures;     // header and frame CRC mismatches since boot
+  uint64_t bytes_written;    // bytes programmed, lifetime (from headers)
+  uint64_t bytes_boot;       // bytes programmed since boot
+  uint32_t wear_min;         // lowest known erase count of any sector
+  uint32_t wear_max;         // highest erase count of any sector
+  uint32_t wear_days_left;   // at the write rate since boot; UINT32_MAX if idle
+} ntc_history_stats_t;
+
 void ntc_history_init(void);
 
+/**
+ * @brief Queue a sample for the writer task. Never waits on flash.
+ */
 void ntc_history_add_record(const float temps[NTC_CHANNELS_COUNT]);
 
+/**
+ * @brief Last sweep of the sensors, logged or not.
+ */
+typedef struct
+{
+  uint32_t sweep;        // sweeps published since boot, 0 before the first
+  uint32_t timestamp;    // time() of the sweep
+  int64_t taken_us;      // esp_timer_get_time() of the sweep, for its age
+  uint32_t valid_mask;   // bit n set when channel n was read correctly
+  int16_t temps_cC[NTC_CHANNELS_COUNT];   // INT16_MIN when invalid
+} ntc_latest_t;
+
+/**
+ * @brief Publish a completed sweep for ntc_history_get_latest().
+ *
+ * Call it for every sweep, with NTC_INVALID_TEMP for the channels that could
+ * not be read. Touches neither flash nor the history lock, and works before
+ * ntc_history_init(). Single writer.
+ */
+void ntc_history_set_latest(const float temps[NTC_CHANNELS_COUNT]);
+
+/**
+ * @brief Copy the last published sweep. Lock-free, never blocks on flash.
+ *
+ * @return false before the first sweep
+ */
+bool ntc_history_get_latest(ntc_latest_t *out);
+
+/**
+ * @brief Write every queued and RAM-buffered sample to flash.
+ *
+ * Blocks until the writer task has processed the request.
+ */
 void ntc_history_flush(void);
 
+/**
+ * @brief Estimated number of records the log can hold.
+ *
+ * Records are delta-compressed, so this is derived from the records per
+ * sector achieved so far.
+ */
 size_t ntc_history_get_capacity(void);
 
+/**
+ * @brief Writer task, flash latency and wear counters.
+ *
+ * Erase counts and bytes written are kept in the sector headers, so they
+ * cover the life of the partition. Everything else (latencies, histograms,
+ * CRC failures, queue counters) lives in RAM and restarts at each boot.
+ * The wear-out projection extrapolates the write rate since boot against
+ * NTC_HISTORY_ENDURANCE_CYCLES, for the ring that wears fastest.
+ */
+void ntc_history_get_stats(ntc_history_stats_t *out);
+
 /**
  * @brief Iterate records in chronological order (oldest -> newest).
  *
- * @param since_ts  Only return records with timestamp >= since_ts (0 disables)
+ * @param since_ts  Only return records with timestamp >= since_ts (0 disables).
+ *                  Sectors entirely older than since_ts are skipped without
+ *                  being read.
  * @param max       Maximum number of records to emit (0 means "no limit",
  *                  but still internally capped for safety in the caller)
  * @param cb        Callback called for each record; return false to stop
@@ -57,6 +174,166 @@ size_t ntc_history_get_capacity(void);
 size_t ntc_history_iterate(uint32_t since_ts, size_t max,
                            ntc_history_iter_cb_t cb, void *ctx);
 
+/**
+ * @brief Iterate the newest records in chronological order (oldest -> newest).
+ *
+ * The start position is located from the in-RAM sector index, so only the
+ * emitted records are read from flash.
+ *
+ * @param since_ts  Only return records with timestamp >= since_ts (0 disables)
+ * @param max       Number of newest records to emit (0 means "no limit")
+ * @param cb        Callback called for each record; return false to stop
+ * @param ctx       User context passed to cb
+ *
+ * @return number of records for which cb was called
+ */
+size_t ntc_history_iterate_tail(uint32_t since_ts, size_t max,
+                                ntc_history_iter_cb_t cb, void *ctx);
+
+/**
+ * @brief Iterate the newest records of a time range in chronological order.
+ *
+ * Like ntc_history_iterate_tail(), bounded above by until_ts. Sectors outside
+ * [since_ts, until_ts) are skipped without being read.
+ *
+ * @param since_ts  Only return records with timestamp >= since_ts (0 disables)
+ * @param until_ts  Only return records with timestamp < until_ts (0 disables)
+ * @param max       Number of newest records to emit (0 means "no limit")
+ * @param cb        Callback called for each record; return false to stop
+ * @param ctx       User context passed to cb
+ *
+ * @return number of records for which cb was called
+ */
+size_t ntc_history_iterate_range(uint32_t since_ts, uint32_t until_ts,
+                                 size_t max, ntc_history_iter_cb_t cb,
+                                 void *ctx);
+
+/**
+ * @brief Iterate the records that follow a sequence number (oldest -> newest).
+ *
+ * For incremental sync: pass the seq of the newest record already held. If
+ * that record has been overwritten meanwhile, iteration starts at the oldest
+ * stored one. Records still buffered in RAM follow the flash ones, with the
+ * seq they will be written under.
+ *
+ * @param after_seq  Only return records with seq > after_seq
+ * @param max        Maximum number of records to emit (0 means "no limit")
+ * @param cb         Callback called for each record; return false to stop
+ * @param ctx        User context passed to cb
+ *
+ * @return number of records for which cb was called
+ */
+size_t ntc_history_iterate_after(uint32_t after_seq, size_t max,
+                                 ntc_history_iter_cb_t cb, void *ctx);
+
+/**
+ * @brief Sequence number of the newest record written to flash.
+ *
+ * 0 while the log is empty. Records still buffered in RAM are not counted.
+ */
+uint32_t ntc_history_last_seq(void);
+
+/**
+ * @brief Sequence number of the oldest record still in flash.
+ *
+ * ntc_history_last_seq() + 1 while the log is empty.
+ */
+uint32_t ntc_history_first_seq(void);
+
+/**
+ * @brief Callback for records as they are taken.
+ *
+ * Runs on the writer task: it must not block.
+ */
+typedef void (*ntc_history_live_cb_t)(const ntc_record_t *rec, void *ctx);
+
+/**
+ * @brief Register a callback for every new record (NULL to remove it).
+ *
+ * Called once per record accepted by ntc_history_add_record(), as soon as
+ * it is buffered, with rec->seq set to the seq it will be stored under.
+ */
+void ntc_history_set_live_cb(ntc_history_live_cb_t cb, void *ctx);
+
+/**
+ * @brief Iterate records in reverse order (newest -> oldest).
+ *
+ * Walks back from the write head and stops reading once max records have
+ * been emitted or the remaining sectors are older than since_ts.
+ *
+ * @param since_ts  Only return records with timestamp >= since_ts (0 disables)
+ * @param max       Maximum number of records to emit (0 means "no limit")
+ * @param cb        Callback called for each record; return false to stop
+ * @param ctx       User context passed to cb
+ *
+ * @return number of records for which cb was called
+ */
+size_t ntc_history_iterate_reverse(uint32_t since_ts, size_t max,
+                                   ntc_history_iter_cb_t cb, void *ctx);
+
+/**
+ * @brief Bucket length of a rollup tier in seconds.
+ *
+ * @param tier  0 .. NTC_HISTORY_TIERS - 1, or -1 for the raw sample period
+ */
+uint32_t ntc_history_tier_interval(int tier);
+
+/**
+ * @brief Iterate the buckets of a rollup tier (oldest -> newest).
+ *
+ * Buckets are written when they close; the one still being filled is not
+ * returned.
+ *
+ * @param tier      0 .. NTC_HISTORY_TIERS - 1
+ * @param since_ts  Only return buckets that end after since_ts (0 disables)
+ * @param max       Maximum number of buckets to emit (0 means "no limit")
+ * @param cb        Callback called for each bucket; return false to stop
+ * @param ctx       User context passed to cb
+ *
+ * @return number of buckets for which cb was called
+ */
+size_t ntc_history_iterate_rollup(int tier, uint32_t since_ts, size_t max,
+                                  ntc_rollup_iter_cb_t cb, void *ctx);
+
+/**
+ * @brief Pick the finest level that can serve a time range.
+ *
+ * A level qualifies when it still holds data back to since_ts (or to the
+ * oldest stored sample) and the range needs at most max_points of its
+ * samples. Falls back to the coarsest level holding data.
+ *
+ * @param since_ts    Range start
+ * @param until_ts    Range end (0 means now)
+ * @param max_points  Point budget (0 means "no limit")
+ *
+ * @return -1 for raw records, otherwise the tier for
+ *         ntc_history_iterate_rollup()
+ */
+int ntc_history_select_tier(uint32_t since_ts, uint32_t until_ts,
+                            size_t max_points);
+
+/**
+ * @brief Reduce a time range to per-channel min/max/mean buckets.
+ *
+ * One streaming pass over the log. Buckets are aligned to multiples of
+ * bucket_seconds; empty buckets are not emitted. Without a percentile, a
+ * rollup tier whose interval divides bucket_seconds serves the range it
+ * covers and only the newest raw records are read. Percentiles always come
+ * from raw records and are approximated to 0.5 degC.
+ *
+ * @param since_ts        Range start (0 disables)
+ * @param until_ts        Range end, exclusive (0 means no limit)
+ * @param bucket_seconds  Bucket length (0 means a single bucket)
+ * @param percentile      1 .. 100 to fill pct_cC, 0 to skip it
+ * @param cb              Callback called for each bucket; return false to stop
+ * @param ctx             User context passed to cb
+ *
+ * @return number of buckets for which cb was called
+ */
+size_t ntc_history_aggregate(uint32_t since_ts, uint32_t until_ts,
+                             uint32_t bucket_seconds, uint8_t percentile,
+                             ntc_aggregate_cb_t cb, void *ctx);
+
 /**
  * @brief Get newest records (chronological order).
  *
@@ -65,6 +342,6 @@ size_t ntc_history_iterate(uint32_t since_ts, size_t max,
 size_t ntc_history_get_records(ntc_record_t *out_records, size_t max_records);
 
 /**
- * @brief Erase the whole partition and re-initialize an empty log.
+ * @brief Erase the whole partition and re-initialize empty logs.
  */
 esp_err_t ntc_history_erase_all(void);
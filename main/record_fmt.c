@@ -0,0 +1,100 @@
+/*
+ * UBAC:record_fmt.c for ESP32 to serialize history records.
+ * Copyright (C) 2026 Côme VINCENT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "record_fmt.h"
+
+#include <string.h>
+
+// "00" "01" ... "99": two digits per division
+static const char s_digits[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+size_t record_fmt_u32(char *out, uint32_t v)
+{
+  // Filled from the end, then moved to the front
+  char tmp[RECORD_FMT_U32_MAX];
+  char *p = tmp + sizeof(tmp);
+
+  while (v >= 100)
+  {
+    uint32_t pair = (v % 100) * 2;
+    v /= 100;
+    *--p = s_digits[pair + 1];
+    *--p = s_digits[pair];
+  }
+  if (v >= 10)
+  {
+    *--p = s_digits[v * 2 + 1];
+    *--p = s_digits[v * 2];
+  }
+  else
+  {
+    *--p = (char) ('0' + v);
+  }
+
+  size_t len = (size_t) (tmp + sizeof(tmp) - p);
+  memcpy(out, p, len);
+  return len;
+}
+
+size_t record_fmt_i32(char *out, int32_t v)
+{
+  if (v >= 0)
+    return record_fmt_u32(out, (uint32_t) v);
+
+  out[0] = '-';
+  return 1 + record_fmt_u32(out + 1, 0u - (uint32_t) v);
+}
+
+static size_t put(char *out, const char *s, size_t len)
+{
+  memcpy(out, s, len);
+  return len;
+}
+
+size_t record_fmt_json(char *out, const ntc_record_t *rec,
+                       const uint8_t *channels, size_t nch, bool with_seq)
+{
+  if (!channels)
+    nch = NTC_CHANNELS_COUNT;
+
+  size_t n = put(out, "{\"t\":", 5);
+  n += record_fmt_u32(out + n, rec->timestamp);
+  n += put(out + n, ",\"s\":", 5);
+  n += record_fmt_i32(out + n, NTC_TEMP_SCALE);
+  if (with_seq)
+  {
+    n += put(out + n, ",\"q\":", 5);
+    n += record_fmt_u32(out + n, rec->seq);
+  }
+  n += put(out + n, ",\"v\":[", 6);
+
+  for (size_t i = 0; i < nch; i++)
+  {
+    if (i)
+      out[n++] = ',';
+    n += record_fmt_i32(out + n, rec->temps_cC[channels ? channels[i] : i]);
+  }
+
+  n += put(out + n, "]}", 2);
+  return n;
+}
@@ -0,0 +1,66 @@
+/*
+ * UBAC:record_fmt.h for ESP32 to serialize history records.
+ * Copyright (C) 2026 Côme VINCENT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "ntc_history.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORD_FMT_U32_MAX  10   // "4294967295"
+#define RECORD_FMT_I32_MAX  11   // "-2147483648"
+
+/**
+ * @brief Longest output of record_fmt_json() (no terminating NUL).
+ *
+ * {"t":<u32>,"s":<i32>,"q":<u32>,"v":[<i16>,...]}
+ */
+#define RECORD_FMT_JSON_MAX \
+  (23 + 2 * RECORD_FMT_U32_MAX + RECORD_FMT_I32_MAX + 7 * NTC_CHANNELS_COUNT)
+
+/**
+ * @brief Write v in decimal, without a terminating NUL.
+ *
+ * @return number of characters written (at most RECORD_FMT_U32_MAX)
+ */
+size_t record_fmt_u32(char *out, uint32_t v);
+
+/**
+ * @brief Write v in decimal, without a terminating NUL.
+ *
+ * @return number of characters written (at most RECORD_FMT_I32_MAX)
+ */
+size_t record_fmt_i32(char *out, int32_t v);
+
+/**
+ * @brief Serialize one record as a JSON object, without a terminating NUL.
+ *
+ * {"t":<timestamp>,"s":<NTC_TEMP_SCALE>,"q":<seq>,"v":[...]} where "q" is
+ * only written with with_seq and v holds the listed channels in order.
+ *
+ * @param out       At least RECORD_FMT_JSON_MAX bytes
+ * @param rec       Record to write
+ * @param channels  Channel of each v entry, NULL for all channels in order
+ * @param nch       Number of entries in channels (ignored when NULL)
+ * @param with_seq  Write the record's seq as "q"
+ *
+ * @return number of characters written
+ */
+size_t record_fmt_json(char *out, const ntc_record_t *rec,
+                       const uint8_t *channels, size_t nch, bool with_seq);
@@ -0,0 +1,119 @@
+/*
+ * UBAC:record_fmt_bench.c host benchmark of the history record serializer.
+ * Copyright (C) 2026 Côme VINCENT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Not part of the firmware (not in the component SRCS). Compares
+ * record_fmt_json() with the single snprintf it replaced, per record,
+ * after checking that both produce the same bytes. Built on the host once
+ * the project has been configured (for sdkconfig.h):
+ *
+ *   cc -O2 -Imain -Ibuild/config -I$IDF_PATH/components/esp_common/include \
+ *      main/record_fmt_bench.c main/record_fmt.c -o record_fmt_bench
+ *   ./record_fmt_bench
+ */
+
+#include "record_fmt.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_RECORDS 2000000
+
+// The /history.json row as the handler wrote it before record_fmt.c, one
+// snprintf with the ten channels spelled out
+_Static_assert(NTC_CHANNELS_COUNT == 10, "the old format has ten channels");
+
+static size_t snprintf_json(char *buf, size_t size, const ntc_record_t *rec)
+{
+  int len = snprintf(
+      buf, size,
+      "{\"t\":%" PRIu32 ",\"s\":%d,"
+      "\"v\":[%d,%d,%d,%d,%d,%d,%d,%d,%d,%d]}",
+      rec->timestamp, NTC_TEMP_SCALE, rec->temps_cC[0],
+      rec->temps_cC[1], rec->temps_cC[2], rec->temps_cC[3],
+      rec->temps_cC[4], rec->temps_cC[5], rec->temps_cC[6],
+      rec->temps_cC[7], rec->temps_cC[8], rec->temps_cC[9]);
+  return (size_t) len;
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Varies the record between calls so that nothing is hoisted out of the loop
+static void next_record(ntc_record_t *rec, int i)
+{
+  rec->timestamp += 120;
+  rec->temps_cC[i % NTC_CHANNELS_COUNT] = (int16_t) (i % 5000 - 1000);
+}
+
+int main(void)
+{
+  char a[RECORD_FMT_JSON_MAX + 1];
+  char b[256];
+
+  ntc_record_t rec = {.timestamp = 1700000000u};
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    rec.temps_cC[ch] = (int16_t) (2000 + ch * 137);
+  }
+
+  // Same output for every record of the timed runs
+  ntc_record_t check = rec;
+  for (int i = 0; i < BENCH_RECORDS; i++)
+  {
+    next_record(&check, i);
+    size_t n = record_fmt_json(a, &check, NULL, 0, false);
+    size_t m = snprintf_json(b, sizeof(b), &check);
+    if (n != m || memcmp(a, b, n) != 0)
+    {
+      a[n] = '\0';
+      fprintf(stderr, "mismatch at %d:\n  %s\n  %s\n", i, a, b);
+      return 1;
+    }
+  }
+
+  volatile size_t sink = 0;
+  ntc_record_t r1 = rec;
+  double t0 = now_sec();
+  for (int i = 0; i < BENCH_RECORDS; i++)
+  {
+    next_record(&r1, i);
+    sink += snprintf_json(b, sizeof(b), &r1);
+  }
+  ntc_record_t r2 = rec;
+  double t1 = now_sec();
+  for (int i = 0; i < BENCH_RECORDS; i++)
+  {
+    next_record(&r2, i);
+    sink += record_fmt_json(a, &r2, NULL, 0, false);
+  }
+  double t2 = now_sec();
+  (void) sink;
+
+  printf("%d records of %d channels\n", BENCH_RECORDS, NTC_CHANNELS_COUNT);
+  printf("snprintf        %6.0f ns/record\n", (t1 - t0) / BENCH_RECORDS * 1e9);
+  printf("record_fmt_json %6.0f ns/record (%.1fx)\n",
+         (t2 - t1) / BENCH_RECORDS * 1e9, (t1 - t0) / (t2 - t1));
+  return 0;
+}
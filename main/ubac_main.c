@@ -63,6 +63,9 @@ void ntc_reader_task(void *pvParameters)
       temps[i] = ntc_get_temp_celsius(i);
       ESP_LOGI(TAG, "NTC %d: Temp: %.2f C", i, temps[i]);
     }
+    // Current values are served from RAM even when the sweep is not logged
+    ntc_history_set_latest(temps);
+
     int is_valid_temps = 1;
     for (int i = 0; i < NTC_CHANNELS_COUNT; i++)
     {
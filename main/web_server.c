@@ -19,13 +19,27 @@
 #include "web_server.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include "deflate_stream.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "ntc_history.h"
+#include "record_fmt.h"
+#include "sdkconfig.h"
 #include "wifi_app.h"
+#include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <math.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
 #include <sys/time.h>
@@ -33,129 +47,1303 @@
 static const char *TAG = "WEB_SERVER";
 static httpd_handle_t server = NULL;
 
-/* HTML Content */
-extern const uint8_t config_html_start[] asm("_binary_config_html_start");
-extern const uint8_t config_html_end[] asm("_binary_config_html_end");
+/* Web assets, gzip-compressed at build time (main/CMakeLists.txt) */
+extern const uint8_t config_html_gz_start[] asm("_binary_config_html_gz_start");
+extern const uint8_t config_html_gz_end[] asm("_binary_config_html_gz_end");
 
-extern const uint8_t dashboard_html_start[] asm("_binary_dashboard_html_start");
-extern const uint8_t dashboard_html_end[] asm("_binary_dashboard_html_end");
+extern const uint8_t dashboard_html_gz_start[] asm("_binary_dashboard_html_gz_start");
+extern const uint8_t dashboard_html_gz_end[] asm("_binary_dashboard_html_gz_end");
+
+extern const uint8_t chart_js_gz_start[] asm("_binary_chart_js_gz_start");
+extern const uint8_t chart_js_gz_end[] asm("_binary_chart_js_gz_end");
+
+typedef struct
+{
+  const uint8_t *start;
+  const uint8_t *end;
+  const char *type;
+  const char *cache;   // Cache-Control
+  char etag[11];       // CRC of the embedded data, set on first use
+} asset_t;
+
+// Pages are revalidated on every load (a 304 when unchanged); the script
+// they pull in is reused for a day without asking
+#define ASSET_CACHE_PAGE    "no-cache"
+#define ASSET_CACHE_SCRIPT  "public, max-age=86400"
+
+static asset_t s_config_html = {config_html_gz_start, config_html_gz_end,
+                                "text/html", ASSET_CACHE_PAGE, ""};
+static asset_t s_dashboard_html = {dashboard_html_gz_start, dashboard_html_gz_end,
+                                   "text/html", ASSET_CACHE_PAGE, ""};
+static asset_t s_chart_js = {chart_js_gz_start, chart_js_gz_end,
+                             "application/javascript", ASSET_CACHE_SCRIPT, ""};
+
+// Sent as stored: every browser accepts gzip, so no plain copy is kept
+static esp_err_t asset_send(httpd_req_t *req, asset_t *a)
+{
+  size_t len = a->end - a->start;
+  if (a->etag[0] == '\0')
+  {
+    snprintf(a->etag, sizeof(a->etag), "\"%08" PRIx32 "\"",
+             esp_rom_crc32_le(0, a->start, len));
+  }
+
+  httpd_resp_set_hdr(req, "ETag", a->etag);
+  httpd_resp_set_hdr(req, "Cache-Control", a->cache);
+
+  char inm[sizeof(a->etag)];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm)) == ESP_OK &&
+      strcmp(inm, a->etag) == 0)
+  {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  httpd_resp_set_type(req, a->type);
+  httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  return httpd_resp_send(req, (const char *) a->start, len);
+}
 
 /* Handler for the root URL */
 static esp_err_t index_get_handler(httpd_req_t *req)
 {
-  httpd_resp_set_type(req, "text/html");
-
   // Check if we are connected to STA
   wifi_ap_record_t ap_info;
   if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+    return asset_send(req, &s_dashboard_html);
+  return asset_send(req, &s_config_html);
+}
+
+static esp_err_t chart_js_get_handler(httpd_req_t *req)
+{
+  return asset_send(req, &s_chart_js);
+}
+
+// Room for any query the server accepts (the whole URI is capped)
+#define QUERY_MAX CONFIG_HTTPD_MAX_URI_LEN
+
+/* Sets *q to the query string copied into buf, NULL without one. A query
+ * that does not fit is answered with 414 and false, rather than served as
+ * if its filters were absent. */
+static bool query_get(httpd_req_t *req, char *buf, size_t size, const char **q)
+{
+  *q = NULL;
+  size_t len = httpd_req_get_url_query_len(req);
+  if (len == 0)
+    return true;
+  if (len >= size)
+  {
+    httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, "query too long");
+    return false;
+  }
+  if (httpd_req_get_url_query_str(req, buf, size) == ESP_OK)
+    *q = buf;
+  return true;
+}
+
+// Plain decimal only: no sign, blanks or overflow
+static bool parse_u32(const char *s, uint32_t *out)
+{
+  if (!isdigit((unsigned char) s[0]))
+    return false;
+
+  errno = 0;
+  char *end;
+  unsigned long long v = strtoull(s, &end, 10);
+  if (*end != '\0' || errno == ERANGE || v > UINT32_MAX)
+    return false;
+  *out = (uint32_t) v;
+  return true;
+}
+
+/* Sets *out to the value of key, def when it is absent. Returns false when
+ * it is present but not a u32, so that the caller answers 400 rather than
+ * serving the default. */
+static bool query_u32(const char *query, const char *key, uint32_t def,
+                      uint32_t *out)
+{
+  *out = def;
+  char val[16];
+  esp_err_t err = query ? httpd_query_key_value(query, key, val, sizeof(val))
+                        : ESP_ERR_NOT_FOUND;
+  if (err == ESP_ERR_NOT_FOUND)
+    return true;
+  return err == ESP_OK && parse_u32(val, out);
+}
+
+/* Async workers
+ *
+ * esp_http_server runs every handler on its one task, so a long history
+ * stream or a Wi-Fi scan would stall every other client, captive portal
+ * probes included. Slow routes are handed to a small worker pool through the
+ * async request API and the server task goes straight back to accepting;
+ * small routes still answer inline. At most ASYNC_MAX_JOBS requests are
+ * running or waiting for a worker, the next ones get 503.
+ */
+#define ASYNC_WORKERS       2
+#define ASYNC_MAX_JOBS      6
+#define ASYNC_WORKER_STACK  8192   // history walks, Wi-Fi scan
+#define ASYNC_RETRY_SEC     "1"
+
+typedef esp_err_t (*req_handler_t)(httpd_req_t *req);
+
+typedef struct
+{
+  httpd_req_t *req;   // async copy
+  req_handler_t handler;
+} async_job_t;
+
+static QueueHandle_t s_async_queue = NULL;
+static SemaphoreHandle_t s_async_slots = NULL;   // ASYNC_MAX_JOBS tokens
+
+static void async_worker_task(void *pvParameters)
+{
+  async_job_t job;
+  while (1)
+  {
+    if (xQueueReceive(s_async_queue, &job, portMAX_DELAY) != pdTRUE)
+      continue;
+
+    job.handler(job.req);
+    httpd_req_async_handler_complete(job.req);
+    xSemaphoreGive(s_async_slots);
+  }
+}
+
+static esp_err_t async_submit(httpd_req_t *req, req_handler_t handler)
+{
+  if (xSemaphoreTake(s_async_slots, 0) != pdTRUE)
+  {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", ASYNC_RETRY_SEC);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, "busy");
+    return ESP_OK;
+  }
+
+  async_job_t job = {.handler = handler};
+  if (httpd_req_async_handler_begin(req, &job.req) != ESP_OK)
   {
-    const char *resp = (const char *) dashboard_html_start;
-    size_t resp_len = strlen(resp);
-    size_t chunk_size = 2048;
-    size_t offset = 0;
+    xSemaphoreGive(s_async_slots);
+    httpd_resp_send_500(req);
+    return ESP_OK;
+  }
+
+  // A slot guarantees room in the queue
+  xQueueSend(s_async_queue, &job, portMAX_DELAY);
+  return ESP_OK;
+}
+
+static esp_err_t async_start(void)
+{
+  s_async_queue = xQueueCreate(ASYNC_MAX_JOBS, sizeof(async_job_t));
+  s_async_slots = xSemaphoreCreateCounting(ASYNC_MAX_JOBS, ASYNC_MAX_JOBS);
+  if (!s_async_queue || !s_async_slots)
+    return ESP_ERR_NO_MEM;
 
-    while (offset < resp_len)
+  for (int i = 0; i < ASYNC_WORKERS; i++)
+  {
+    if (xTaskCreate(async_worker_task, "http_async", ASYNC_WORKER_STACK, NULL,
+                    5, NULL) != pdPASS)
+      return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+/* Buffered chunked responses
+ *
+ * Streams write into a resp_buf_t and it goes out as whole chunks sized to
+ * fill one TCP segment with the chunk framing ("5a0\r\n" ... "\r\n"), rather
+ * than one chunk and socket write per row.
+ */
+#define RESP_BUF_SIZE (CONFIG_LWIP_TCP_MSS - 8)
+
+typedef struct
+{
+  httpd_req_t *req;
+  size_t len;
+  bool failed;   // a send failed: the rest is dropped
+  deflate_stream_t *z;   // content coding, NULL for identity
+  int64_t z_us;          // in the compressor, sends excluded
+  int64_t send_us;
+  char buf[RESP_BUF_SIZE];
+} resp_buf_t;
+
+// Totals of the compressed responses, for /storage.json
+static atomic_uint s_z_streams;
+static atomic_uint s_z_in;
+static atomic_uint s_z_out;
+static atomic_uint s_z_us;
+
+static void resp_buf_init(resp_buf_t *b, httpd_req_t *req)
+{
+  b->req = req;
+  b->len = 0;
+  b->failed = false;
+  b->z = NULL;
+  b->z_us = 0;
+  b->send_us = 0;
+}
+
+static bool resp_buf_z_out(const uint8_t *data, size_t len, void *ctx)
+{
+  resp_buf_t *b = (resp_buf_t *) ctx;
+  int64_t t0 = esp_timer_get_time();
+  bool ok = httpd_resp_send_chunk(b->req, (const char *) data, len) == ESP_OK;
+  b->send_us += esp_timer_get_time() - t0;
+  return ok;
+}
+
+// True when the Accept-Encoding list has coding with a non-zero q
+static bool accepts_coding(const char *list, const char *coding)
+{
+  size_t n = strlen(coding);
+  for (const char *p = list; *p;)
+  {
+    while (*p == ' ' || *p == ',')
+      p++;
+    const char *end = p + strcspn(p, ",");
+    if (strncasecmp(p, coding, n) == 0 && (p[n] == ';' || p[n] == ' ' || p + n == end))
     {
-      size_t len = resp_len - offset;
-      if (len > chunk_size)
-      {
-        len = chunk_size;
-      }
-      if (httpd_resp_send_chunk(req, resp + offset, len) != ESP_OK)
-      {
-        return ESP_FAIL;
-      }
-      offset += len;
+      const char *q = strstr(p, "q=");
+      return !(q && q < end && strtod(q + 2, NULL) <= 0.0);
     }
-    httpd_resp_send_chunk(req, NULL, 0);
+    p = end;
+  }
+  return false;
+}
+
+// Responses that may be compressed, 304s included, vary with the client
+static void resp_set_vary(httpd_req_t *req)
+{
+#if CONFIG_HTTP_COMPRESS
+  httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+#endif
+}
+
+// Compresses the rest of the response when the client accepts it. Call
+// before anything is sent; falls back to identity when out of memory.
+static void resp_buf_compress(resp_buf_t *b)
+{
+#if CONFIG_HTTP_COMPRESS
+  resp_set_vary(b->req);
+
+  char accept[96];
+  esp_err_t err = httpd_req_get_hdr_value_str(b->req, "Accept-Encoding", accept, sizeof(accept));
+  if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC)
+    return;
+
+  deflate_stream_format_t format;
+  const char *coding;
+  if (accepts_coding(accept, "gzip"))
+  {
+    format = DEFLATE_STREAM_GZIP;
+    coding = "gzip";
+  }
+  else if (accepts_coding(accept, "deflate"))
+  {
+    format = DEFLATE_STREAM_ZLIB;
+    coding = "deflate";
   }
   else
   {
-    httpd_resp_send(req, (const char *) config_html_start, HTTPD_RESP_USE_STRLEN);
+    return;
   }
-  return ESP_OK;
+
+  b->z = deflate_stream_new(format, RESP_BUF_SIZE, resp_buf_z_out, b);
+  if (!b->z)
+  {
+    ESP_LOGW(TAG, "No memory to compress, sending identity");
+    return;
+  }
+  httpd_resp_set_hdr(b->req, "Content-Encoding", coding);
+#endif
+}
+
+static bool resp_buf_send(resp_buf_t *b, const void *data, size_t len)
+{
+  if (b->failed)
+    return false;
+
+  if (b->z)
+  {
+    int64_t t0 = esp_timer_get_time();
+    int64_t sent = b->send_us;
+    b->failed = !deflate_stream_write(b->z, data, len);
+    b->z_us += esp_timer_get_time() - t0 - (b->send_us - sent);
+  }
+  else
+  {
+    b->failed = httpd_resp_send_chunk(b->req, data, len) != ESP_OK;
+  }
+  return !b->failed;
 }
 
-/* Handler for /history.json */
+static bool resp_buf_flush(resp_buf_t *b)
+{
+  if (b->len > 0)
+    resp_buf_send(b, b->buf, b->len);
+  b->len = 0;
+  return !b->failed;
+}
+
+static bool resp_buf_write(resp_buf_t *b, const void *data, size_t len)
+{
+  if (b->len + len > RESP_BUF_SIZE && !resp_buf_flush(b))
+    return false;
+
+  // Larger than the whole buffer: pass it straight through
+  if (len > RESP_BUF_SIZE)
+    return resp_buf_send(b, data, len);
+
+  memcpy(b->buf + b->len, data, len);
+  b->len += len;
+  return !b->failed;
+}
+
+// Room for len bytes written in place, then resp_buf_commit(); NULL once a
+// send failed
+static char *resp_buf_reserve(resp_buf_t *b, size_t len)
+{
+  if (b->len + len > RESP_BUF_SIZE && !resp_buf_flush(b))
+    return NULL;
+  return b->failed ? NULL : b->buf + b->len;
+}
+
+static void resp_buf_commit(resp_buf_t *b, size_t len)
+{
+  b->len += len;
+}
+
+static bool resp_buf_puts(resp_buf_t *b, const char *s)
+{
+  return resp_buf_write(b, s, strlen(s));
+}
+
+// Formats in place; a result that does not fit what is left is retried in
+// an empty buffer, and fails if it cannot fit at all
+static bool resp_buf_printf(resp_buf_t *b, const char *fmt, ...)
+{
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(b->buf + b->len, RESP_BUF_SIZE - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= RESP_BUF_SIZE)
+      break;
+    if ((size_t) n < RESP_BUF_SIZE - b->len)
+    {
+      b->len += n;
+      return !b->failed;
+    }
+    if (!resp_buf_flush(b))
+      return false;
+  }
+  b->failed = true;
+  return false;
+}
+
+// Flushes what is left and terminates the chunked response
+static bool resp_buf_end(resp_buf_t *b)
+{
+  resp_buf_flush(b);
+
+  if (b->z)
+  {
+    int64_t t0 = esp_timer_get_time();
+    int64_t sent = b->send_us;
+    if (!b->failed)
+      b->failed = !deflate_stream_finish(b->z);
+    b->z_us += esp_timer_get_time() - t0 - (b->send_us - sent);
+
+    uint32_t in, out;
+    deflate_stream_totals(b->z, &in, &out);
+    atomic_fetch_add(&s_z_streams, 1);
+    atomic_fetch_add(&s_z_in, in);
+    atomic_fetch_add(&s_z_out, out);
+    atomic_fetch_add(&s_z_us, (unsigned) b->z_us);
+    deflate_stream_free(b->z);
+    b->z = NULL;
+  }
+
+  if (b->failed)
+    return false;
+  return httpd_resp_send_chunk(b->req, NULL, 0) == ESP_OK;
+}
+
+/* Handlers for /history.json and /history.bin
+ *
+ * /history.bin streams the same selection as packed little-endian data:
+ *
+ *   header   "NTCH"    4 bytes magic
+ *            u8        format version (HISTORY_BIN_VERSION)
+ *            u8        n, channels per record
+ *            u16       temperature scale (NTC_TEMP_SCALE, centi-degrees)
+ *            u8[n]     channel number of each record column
+ *   records  u32       timestamp, unix seconds
+ *            i16[n]    temperatures, -32768 when invalid
+ *
+ * Records follow the header back to back (4 + 2n bytes each) until the end
+ * of the response, oldest first.
+ *
+ * Incremental sync: both routes send ETag and X-Last-Seq, the seq of the
+ * newest record covered by the response. A poll with If-None-Match gets 304
+ * until a record is written; ?after_seq=<X-Last-Seq> returns only newer
+ * records (JSON rows then carry their seq in "q"). A sync response covers at
+ * most max seqs, and X-Last-Seq then stops there: keep polling with it until
+ * a response comes back empty.
+ */
+#define HISTORY_MAX_RECORDS 5000   // largest dashboard "max points" choice
+#define HISTORY_MAX_POINTS  5000
+#define HISTORY_BIN_VERSION 1
+
+// Streaming reducer: the range is cut into equal time buckets and each one
+// yields the per-channel minimum and maximum as two rows, the earlier extreme
+// first, so peaks survive at any zoom level.
 typedef struct
 {
-  httpd_req_t *req;
+  uint32_t start;   // first bucket start, set by the first record
+  uint32_t width;   // bucket length in seconds, 0 until started
+  uint32_t buckets;
+  uint32_t index;   // bucket being filled, never goes back
+  uint32_t n;       // records in it
+  uint32_t first_ts;
+  uint32_t last_ts;
+  int16_t lo[NTC_CHANNELS_COUNT];
+  int16_t hi[NTC_CHANNELS_COUNT];
+  uint32_t lo_ts[NTC_CHANNELS_COUNT];
+  uint32_t hi_ts[NTC_CHANNELS_COUNT];
+} minmax_t;
+
+typedef struct
+{
+  resp_buf_t *out;
   size_t count;
-  size_t skip;
-  size_t seen;
+  uint8_t channels[NTC_CHANNELS_COUNT];   // projection, in output order
+  size_t nch;
+  uint32_t points;    // reduce to about this many rows, 0 sends every record
+  uint32_t end_ts;    // range end, for the bucket width
+  minmax_t mm;
+  bool binary;        // /history.bin
+  bool sync;          // after_seq given: filter here, rows carry their seq
+  uint32_t since_ts;
+  uint32_t until_ts;
+  uint32_t upto_seq;  // newest record at request start (X-Last-Seq)
+  uint32_t tier_interval;   // rollup rows: bucket length
+  uint32_t tail_ts;         // rollup rows: raw records from here on
 } stream_ctx_t;
 
+static bool history_emit(stream_ctx_t *c, const ntc_record_t *rec)
+{
+  if (c->binary)
+  {
+    uint8_t row[sizeof(uint32_t) + NTC_CHANNELS_COUNT * sizeof(int16_t)];
+    memcpy(row, &rec->timestamp, sizeof(uint32_t));
+    for (size_t i = 0; i < c->nch; i++)
+    {
+      memcpy(row + sizeof(uint32_t) + i * sizeof(int16_t),
+             &rec->temps_cC[c->channels[i]], sizeof(int16_t));
+    }
+    c->count++;
+    // The ESP32 is little-endian: rows are copied as they are
+    return resp_buf_write(c->out, row, sizeof(uint32_t) + c->nch * sizeof(int16_t));
+  }
+
+  char *p = resp_buf_reserve(c->out, 1 + RECORD_FMT_JSON_MAX);
+  if (!p)
+    return false;
+  p[0] = c->count ? ',' : '[';
+  size_t len = 1 + record_fmt_json(p + 1, rec, c->channels, c->nch, c->sync);
+  resp_buf_commit(c->out, len);
+
+  c->count++;
+  return true;
+}
+
+static bool minmax_flush(stream_ctx_t *c)
+{
+  minmax_t *m = &c->mm;
+  if (m->n == 0)
+    return true;
+
+  ntc_record_t first = {.timestamp = m->first_ts};
+  ntc_record_t second = {.timestamp = m->last_ts};
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    bool lo_first = m->lo_ts[ch] <= m->hi_ts[ch];
+    first.temps_cC[ch] = lo_first ? m->lo[ch] : m->hi[ch];
+    second.temps_cC[ch] = lo_first ? m->hi[ch] : m->lo[ch];
+  }
+
+  bool ok = history_emit(c, &first);
+  if (ok && m->n > 1)
+    ok = history_emit(c, &second);
+  m->n = 0;
+  return ok;
+}
+
+// Folds a sample (lo == hi) or a rollup bucket into the current bucket
+static bool minmax_add(stream_ctx_t *c, uint32_t ts,
+                       const int16_t lo[NTC_CHANNELS_COUNT],
+                       const int16_t hi[NTC_CHANNELS_COUNT])
+{
+  minmax_t *m = &c->mm;
+  if (m->width == 0)
+  {
+    // Two rows per bucket
+    m->buckets = (c->points + 1) / 2;
+    uint32_t span = (c->end_ts > ts) ? c->end_ts - ts : 0;
+    m->start = ts;
+    m->width = span / m->buckets + 1;
+  }
+
+  // The clock restarts at each boot, so records are not always in time
+  // order: out of range ones join the first or last bucket, and earlier
+  // ones the current bucket, which keeps the output within points rows
+  uint32_t index = 0;
+  if (ts > m->start)
+    index = (ts - m->start) / m->width;
+  if (index >= m->buckets)
+    index = m->buckets - 1;
+  if (index < m->index)
+    index = m->index;
+  if (m->n > 0 && index != m->index && !minmax_flush(c))
+    return false;
+
+  if (m->n == 0)
+  {
+    m->index = index;
+    m->first_ts = ts;
+    for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+    {
+      m->lo[ch] = INT16_MIN;
+      m->hi[ch] = INT16_MIN;
+    }
+  }
+  m->n++;
+  m->last_ts = ts;
+
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    if (lo[ch] != INT16_MIN && (m->lo[ch] == INT16_MIN || lo[ch] < m->lo[ch]))
+    {
+      m->lo[ch] = lo[ch];
+      m->lo_ts[ch] = ts;
+    }
+    if (hi[ch] != INT16_MIN && (m->hi[ch] == INT16_MIN || hi[ch] > m->hi[ch]))
+    {
+      m->hi[ch] = hi[ch];
+      m->hi_ts[ch] = ts;
+    }
+  }
+  return true;
+}
+
 static bool history_stream_cb(const ntc_record_t *rec, void *ctx)
 {
   stream_ctx_t *c = (stream_ctx_t *) ctx;
+  if (c->sync)
+  {
+    // Walked by seq, so the time range is applied here
+    if (rec->seq > c->upto_seq || (c->until_ts != 0 && rec->timestamp >= c->until_ts))
+      return false;
+    if (rec->timestamp < c->since_ts)
+      return true;
+  }
+  if (c->points == 0)
+    return history_emit(c, rec);
+  return minmax_add(c, rec->timestamp, rec->temps_cC, rec->temps_cC);
+}
 
-  if (c->seen < c->skip)
+// Rows of a rollup tier, for long ranges: each folds its min and max
+static bool history_rollup_cb(const ntc_rollup_t *row, void *ctx)
+{
+  stream_ctx_t *c = (stream_ctx_t *) ctx;
+  if (c->until_ts != 0 && row->timestamp >= c->until_ts)
+    return false;
+  c->tail_ts = row->timestamp + c->tier_interval;
+  return minmax_add(c, row->timestamp, row->min_cC, row->max_cC);
+}
+
+// "0,3,7" -> channel list; false on a malformed or out of range entry
+static bool parse_channels(const char *list, stream_ctx_t *c)
+{
+  c->nch = 0;
+  while (*list)
   {
-    c->seen++;
-    return true;
+    char *end;
+    unsigned long ch = strtoul(list, &end, 10);
+    if (end == list || ch >= NTC_CHANNELS_COUNT || c->nch >= NTC_CHANNELS_COUNT)
+      return false;
+    c->channels[c->nch++] = (uint8_t) ch;
+
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return false;
+    list = end;
   }
+  return c->nch > 0;
+}
+
+static void history_walk(stream_ctx_t *c, uint32_t after_seq, uint32_t max)
+{
+  int tier = -1;
+  if (!c->sync && c->points != 0)
+    tier = ntc_history_select_tier(c->since_ts, c->until_ts, c->points);
 
-  if (c->count == 0)
+  if (c->sync)
   {
-    httpd_resp_sendstr_chunk(c->req, "[");
+    ntc_history_iterate_after(after_seq, max, history_stream_cb, c);
+  }
+  else if (tier >= 0)
+  {
+    // Closed buckets from the coarsest tier that fits the point budget, then
+    // the raw records of the bucket still open
+    c->tier_interval = ntc_history_tier_interval(tier);
+    c->tail_ts = c->since_ts;
+    ntc_history_iterate_rollup(tier, c->since_ts, 0, history_rollup_cb, c);
+    if (!c->out->failed)
+      ntc_history_iterate_range(c->tail_ts, c->until_ts, 0, history_stream_cb, c);
   }
   else
   {
-    httpd_resp_sendstr_chunk(c->req, ",");
+    ntc_history_iterate_range(c->since_ts, c->until_ts, max, history_stream_cb, c);
   }
 
-  char buf[256];
-  int len = snprintf(
-      buf, sizeof(buf),
-      "{\"t\":%" PRIu32 ",\"s\":%d,"
-      "\"v\":[%d,%d,%d,%d,%d,%d,%d,%d,%d,%d]}",
-      rec->timestamp, NTC_TEMP_SCALE, rec->temps_cC[0],
-      rec->temps_cC[1], rec->temps_cC[2], rec->temps_cC[3],
-      rec->temps_cC[4], rec->temps_cC[5], rec->temps_cC[6],
-      rec->temps_cC[7], rec->temps_cC[8], rec->temps_cC[9]);
-
-  httpd_resp_send_chunk(c->req, buf, len);
-  c->count++;
-
-  return true;
+  if (c->points != 0)
+    minmax_flush(c);
 }
 
-static esp_err_t history_get_handler(httpd_req_t *req)
+// ?since=&until=&last=&max=&ch=&points= ; last (seconds back from now on the
+// device clock) overrides since, ch is a comma separated channel list. With
+// points, the whole range is reduced to about that many rows and max is
+// ignored; long ranges are then read from the coarsest rollup tier that
+// still fits the budget (ntc_history_select_tier()). The binary export has no default record cap. after_seq switches
+// to incremental sync (see above), where points is ignored.
+static esp_err_t history_send(httpd_req_t *req, bool binary)
 {
-  httpd_resp_set_type(req, "application/json");
+  char query[QUERY_MAX];
+  const char *q;
+  if (!query_get(req, query, sizeof(query), &q))
+    return ESP_OK;
 
   stream_ctx_t ctx = {
-      .req = req,
       .count = 0,
-      .skip = 0,
-      .seen = 0,
+      .nch = NTC_CHANNELS_COUNT,
+      .binary = binary,
   };
+  for (size_t i = 0; i < NTC_CHANNELS_COUNT; i++)
+  {
+    ctx.channels[i] = (uint8_t) i;
+  }
+
+  char ch_list[48];
+  esp_err_t ch_err = q ? httpd_query_key_value(q, "ch", ch_list, sizeof(ch_list))
+                       : ESP_ERR_NOT_FOUND;
+  if (ch_err != ESP_ERR_NOT_FOUND &&
+      (ch_err != ESP_OK || !parse_channels(ch_list, &ctx)))
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad ch list");
+    return ESP_OK;
+  }
+
+  uint32_t since, until, last, max, after_seq, points;
+  if (!query_u32(q, "since", 0, &since) || !query_u32(q, "until", 0, &until) ||
+      !query_u32(q, "last", 0, &last) ||
+      !query_u32(q, "max", binary ? 0 : HISTORY_MAX_RECORDS, &max) ||
+      !query_u32(q, "after_seq", 0, &after_seq) ||
+      !query_u32(q, "points", 0, &points))
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad number in query");
+    return ESP_OK;
+  }
+
+  if (last != 0)
+  {
+    uint32_t now = (uint32_t) time(NULL);
+    since = (now > last) ? now - last : 0;
+  }
+
+  if (!binary && (max == 0 || max > HISTORY_MAX_RECORDS))
+    max = HISTORY_MAX_RECORDS;
+
+  char after[12];
+  ctx.sync = q && httpd_query_key_value(q, "after_seq", after, sizeof(after)) !=
+                      ESP_ERR_NOT_FOUND;
+
+  uint32_t upto = ntc_history_last_seq();
+  if (ctx.sync && max != 0)
+  {
+    // Seqs are consecutive: cover at most max of them, from the cursor or
+    // the oldest record left, so that X-Last-Seq resumes right after this
+    // response instead of skipping what max cut off
+    uint32_t from = MAX(after_seq, ntc_history_first_seq() - 1);
+    if (from < upto && upto - from > max)
+      upto = from + max;
+  }
+
+  ctx.since_ts = since;
+  ctx.until_ts = until;
+  ctx.upto_seq = upto;
+
+  ctx.points = ctx.sync ? 0 : points;
+  if (ctx.points > HISTORY_MAX_POINTS)
+    ctx.points = HISTORY_MAX_POINTS;
+  if (ctx.points != 0)
+  {
+    ctx.end_ts = (until != 0) ? until : (uint32_t) time(NULL) + 1;
+    max = 0;
+  }
+  // The seq bound above is the cap: rows dropped by since must not use it up
+  if (ctx.sync)
+    max = 0;
+
+  // Weak: the same data may go out gzip, deflate or identity coded
+  char etag[18];
+  char last_seq[12];
+  snprintf(etag, sizeof(etag), "W/\"%" PRIu32 "\"", upto);
+  snprintf(last_seq, sizeof(last_seq), "%" PRIu32, upto);
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "X-Last-Seq", last_seq);
+
+  // Nothing written since the client's copy: headers only
+  char inm[sizeof(etag)];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm)) == ESP_OK &&
+      strcmp(inm, etag) == 0)
+  {
+    resp_set_vary(req);
+    httpd_resp_set_status(req, "304 Not Modified");
+    httpd_resp_send(req, NULL, 0);
+    return ESP_OK;
+  }
+
+  // Holds the whole request's output between chunks
+  resp_buf_t out;
+  resp_buf_init(&out, req);
+  ctx.out = &out;
+  resp_buf_compress(&out);
+
+  if (binary)
+  {
+    httpd_resp_set_type(req, "application/octet-stream");
+    uint8_t hdr[8] = {'N', 'T', 'C', 'H', HISTORY_BIN_VERSION, (uint8_t) ctx.nch,
+                      NTC_TEMP_SCALE & 0xFF, NTC_TEMP_SCALE >> 8};
+    resp_buf_write(&out, hdr, sizeof(hdr));
+    resp_buf_write(&out, ctx.channels, ctx.nch);
+
+    history_walk(&ctx, after_seq, max);
+    resp_buf_end(&out);
+    return ESP_OK;
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  history_walk(&ctx, after_seq, max);
+
+  resp_buf_puts(&out, ctx.count ? "]" : "[]");
+  resp_buf_end(&out);
+  return ESP_OK;
+}
+
+static esp_err_t history_json_run(httpd_req_t *req)
+{
+  return history_send(req, false);
+}
+
+static esp_err_t history_bin_run(httpd_req_t *req)
+{
+  return history_send(req, true);
+}
+
+static esp_err_t history_get_handler(httpd_req_t *req)
+{
+  return async_submit(req, history_json_run);
+}
+
+static esp_err_t history_bin_get_handler(httpd_req_t *req)
+{
+  return async_submit(req, history_bin_run);
+}
+
+/* Handler for /events
+ *
+ * Server-Sent Events: each record is pushed as soon as it is taken, as
+ *
+ *   id: <seq>
+ *   data: {"t":<timestamp>,"s":<scale>,"q":<seq>,"v":[<10 channels>]}
+ *
+ * On reconnect the browser sends the last id in Last-Event-ID and the
+ * records missed meanwhile are replayed first (from flash and the RAM
+ * buffer); ?after_seq=<X-Last-Seq> does the same for the first connection.
+ * Without either the stream starts with the next record. A client more than
+ * SSE_REPLAY_MAX records behind gets "event: reload" and the stream ends:
+ * it should reload from /history.json and reconnect from there.
+ *
+ * The handler hands the connection to sse_task, which owns every client:
+ * the writer task only posts records to its queue. When every slot is
+ * taken, a new stream replaces the oldest one, which is ended so that its
+ * browser reconnects later rather than being locked out.
+ */
+#define SSE_MAX_CLIENTS   3
+#define SSE_QUEUE_LEN     8
+#define SSE_REPLAY_MAX    512    // records replayed on (re)connect
+#define SSE_KEEPALIVE_MS  15000
+#define SSE_TASK_STACK    6144
+#define SSE_RETRY_MS      5000
+
+typedef struct
+{
+  httpd_req_t *req;     // async copy, NULL for a record
+  uint32_t after_seq;   // resume cursor of a new client
+  bool resume;
+  ntc_record_t rec;
+} sse_msg_t;
+
+typedef struct
+{
+  httpd_req_t *req;     // NULL when the slot is free
+  uint32_t last_seq;    // newest seq sent, 0 before the first one
+  uint32_t opened;      // connection order, to find the oldest
+  bool failed;          // a send failed during a replay
+} sse_client_t;
+
+static QueueHandle_t s_sse_queue = NULL;
+static sse_client_t s_sse_clients[SSE_MAX_CLIENTS];   // sse_task only
+static uint32_t s_sse_opened = 0;                      // sse_task only
+
+static void sse_drop(sse_client_t *cl)
+{
+  httpd_req_async_handler_complete(cl->req);
+  cl->req = NULL;
+}
+
+static bool sse_send_record(sse_client_t *cl, const ntc_record_t *rec)
+{
+  char buf[16 + RECORD_FMT_U32_MAX + RECORD_FMT_JSON_MAX];
+  size_t len = 0;
+  memcpy(buf, "id: ", 4);
+  len += 4;
+  len += record_fmt_u32(buf + len, rec->seq);
+  memcpy(buf + len, "\ndata: ", 7);
+  len += 7;
+  len += record_fmt_json(buf + len, rec, NULL, 0, true);
+  memcpy(buf + len, "\n\n", 2);
+  len += 2;
+
+  if (httpd_resp_send_chunk(cl->req, buf, len) != ESP_OK)
+    return false;
+  cl->last_seq = rec->seq;
+  return true;
+}
+
+static bool sse_replay_cb(const ntc_record_t *rec, void *ctx)
+{
+  sse_client_t *cl = (sse_client_t *) ctx;
+  cl->failed = !sse_send_record(cl, rec);
+  return !cl->failed;
+}
+
+// Records after cl->last_seq, up to max; false when the client is gone
+static bool sse_replay(sse_client_t *cl, uint32_t max)
+{
+  cl->failed = false;
+  ntc_history_iterate_after(cl->last_seq, max, sse_replay_cb, cl);
+  return !cl->failed;
+}
+
+static void sse_keepalive(void)
+{
+  for (int i = 0; i < SSE_MAX_CLIENTS; i++)
+  {
+    sse_client_t *cl = &s_sse_clients[i];
+    if (cl->req && httpd_resp_sendstr_chunk(cl->req, ": ping\n\n") != ESP_OK)
+      sse_drop(cl);
+  }
+}
+
+// Too far behind to catch up from here without stalling the other streams
+static void sse_reload(sse_client_t *cl)
+{
+  httpd_resp_sendstr_chunk(cl->req, "event: reload\ndata:\n\n");
+  httpd_resp_send_chunk(cl->req, NULL, 0);
+  sse_drop(cl);
+}
+
+static sse_client_t *sse_free_slot(void)
+{
+  for (int i = 0; i < SSE_MAX_CLIENTS; i++)
+  {
+    if (!s_sse_clients[i].req)
+      return &s_sse_clients[i];
+  }
+  return NULL;
+}
+
+static void sse_add_client(const sse_msg_t *msg)
+{
+  sse_client_t *cl = sse_free_slot();
+  if (!cl)
+  {
+    // Closed pages are only noticed when a send fails: probe them first
+    sse_keepalive();
+    cl = sse_free_slot();
+  }
+  if (!cl)
+  {
+    cl = &s_sse_clients[0];
+    for (int i = 1; i < SSE_MAX_CLIENTS; i++)
+    {
+      if ((int32_t) (s_sse_clients[i].opened - cl->opened) < 0)
+        cl = &s_sse_clients[i];
+    }
+    ESP_LOGI(TAG, "Event streams full, closing the oldest one");
+    httpd_resp_send_chunk(cl->req, NULL, 0);
+    sse_drop(cl);
+  }
 
-  size_t max = 1024;
+  cl->req = msg->req;
+  cl->last_seq = msg->after_seq;
+  cl->opened = s_sse_opened++;
 
-  size_t actual_total = ntc_history_iterate(0, 0, NULL, NULL);
-  if (actual_total > max)
+  char retry[24];
+  snprintf(retry, sizeof(retry), "retry: %d\n\n", SSE_RETRY_MS);
+  bool ok = httpd_resp_sendstr_chunk(cl->req, retry) == ESP_OK;
+  if (ok && msg->resume)
   {
-    ctx.skip = actual_total - max;
+    uint32_t newest = ntc_history_last_seq();
+    if (newest > cl->last_seq && newest - cl->last_seq > SSE_REPLAY_MAX)
+    {
+      sse_reload(cl);
+      return;
+    }
+    ok = sse_replay(cl, SSE_REPLAY_MAX);
   }
+  if (!ok)
+    sse_drop(cl);
+}
 
-  ntc_history_iterate(0, 0, history_stream_cb, &ctx);
+static void sse_broadcast(const ntc_record_t *rec)
+{
+  for (int i = 0; i < SSE_MAX_CLIENTS; i++)
+  {
+    sse_client_t *cl = &s_sse_clients[i];
+    if (!cl->req || (cl->last_seq != 0 && rec->seq <= cl->last_seq))
+      continue;
 
-  if (ctx.count == 0)
+    // A record dropped from the full queue leaves a gap: fill it first
+    bool ok = true;
+    if (cl->last_seq != 0 && rec->seq > cl->last_seq + 1)
+    {
+      uint32_t gap = rec->seq - cl->last_seq - 1;
+      if (gap > SSE_REPLAY_MAX)
+      {
+        sse_reload(cl);
+        continue;
+      }
+      ok = sse_replay(cl, gap);
+    }
+    if (ok && rec->seq > cl->last_seq)
+      ok = sse_send_record(cl, rec);
+    if (!ok)
+      sse_drop(cl);
+  }
+}
+
+static void sse_task(void *pvParameters)
+{
+  sse_msg_t msg;
+  while (1)
   {
-    httpd_resp_send(req, "[]", 2);
+    if (xQueueReceive(s_sse_queue, &msg, pdMS_TO_TICKS(SSE_KEEPALIVE_MS)) != pdTRUE)
+    {
+      sse_keepalive();
+      continue;
+    }
+
+    if (msg.req)
+      sse_add_client(&msg);
+    else
+      sse_broadcast(&msg.rec);
+  }
+}
+
+// Runs on the history writer task: never block it
+static void sse_live_cb(const ntc_record_t *rec, void *ctx)
+{
+  sse_msg_t msg = {.rec = *rec};
+  xQueueSend(s_sse_queue, &msg, 0);
+}
+
+static esp_err_t events_get_handler(httpd_req_t *req)
+{
+  sse_msg_t msg = {0};
+
+  char cursor[12];
+  if (httpd_req_get_hdr_value_str(req, "Last-Event-ID", cursor, sizeof(cursor)) == ESP_OK)
+  {
+    msg.resume = true;
+    if (!parse_u32(cursor, &msg.after_seq))
+    {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad Last-Event-ID");
+      return ESP_OK;
+    }
   }
   else
   {
-    httpd_resp_sendstr_chunk(req, "]");
-    httpd_resp_send_chunk(req, NULL, 0);
+    char query[QUERY_MAX];
+    const char *q;
+    if (!query_get(req, query, sizeof(query), &q))
+      return ESP_OK;
+    if (!query_u32(q, "after_seq", 0, &msg.after_seq))
+    {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad after_seq");
+      return ESP_OK;
+    }
+    msg.resume = q && httpd_query_key_value(q, "after_seq", cursor, sizeof(cursor)) !=
+                          ESP_ERR_NOT_FOUND;
+  }
+
+  httpd_resp_set_type(req, "text/event-stream");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+  // The connection outlives this handler: sse_task sends on the copy
+  if (httpd_req_async_handler_begin(req, &msg.req) != ESP_OK)
+  {
+    httpd_resp_send_500(req);
+    return ESP_OK;
+  }
+  if (xQueueSend(s_sse_queue, &msg, pdMS_TO_TICKS(1000)) != pdTRUE)
+  {
+    httpd_resp_send_500(msg.req);
+    httpd_req_async_handler_complete(msg.req);
+  }
+  return ESP_OK;
+}
+
+/* Handler for /stats.json */
+#define STATS_DEFAULT_SPAN_SEC (24 * 3600)
+#define STATS_DEFAULT_BUCKET   3600
+
+static int append_cC(char *buf, size_t size, int len, const char *name,
+                     const int16_t v[NTC_CHANNELS_COUNT])
+{
+  len += snprintf(buf + len, size - len, ",\"%s\":[", name);
+  for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
+  {
+    if (v[ch] == INT16_MIN)
+      len += snprintf(buf + len, size - len, "%snull", ch ? "," : "");
+    else
+      len += snprintf(buf + len, size - len, "%s%d", ch ? "," : "", v[ch]);
+  }
+  len += snprintf(buf + len, size - len, "]");
+  return len;
+}
+
+typedef struct
+{
+  resp_buf_t *out;
+  size_t count;
+  bool pct;
+} stats_ctx_t;
+
+static bool stats_stream_cb(const ntc_aggregate_t *b, void *ctx)
+{
+  stats_ctx_t *c = (stats_ctx_t *) ctx;
+
+  char buf[512];
+  int len = snprintf(buf, sizeof(buf), "%s{\"t\":%" PRIu32 ",\"n\":%" PRIu32,
+                     c->count ? "," : "", b->timestamp, b->count);
+  len = append_cC(buf, sizeof(buf), len, "min", b->min_cC);
+  len = append_cC(buf, sizeof(buf), len, "max", b->max_cC);
+  len = append_cC(buf, sizeof(buf), len, "mean", b->mean_cC);
+  if (c->pct)
+    len = append_cC(buf, sizeof(buf), len, "p", b->pct_cC);
+  len += snprintf(buf + len, sizeof(buf) - len, "}");
+
+  c->count++;
+  return resp_buf_write(c->out, buf, len);
+}
+
+// ?since=&until=&bucket=&pct= ; since defaults to the last 24 h, bucket to
+// one hour (0 gives a single bucket), pct to none
+static esp_err_t stats_run(httpd_req_t *req)
+{
+  char query[QUERY_MAX];
+  const char *q;
+  if (!query_get(req, query, sizeof(query), &q))
+    return ESP_OK;
+
+  uint32_t now = (uint32_t) time(NULL);
+  uint32_t since, until, bucket, pct;
+  if (!query_u32(q, "since",
+                 now > STATS_DEFAULT_SPAN_SEC ? now - STATS_DEFAULT_SPAN_SEC : 0,
+                 &since) ||
+      !query_u32(q, "until", 0, &until) ||
+      !query_u32(q, "bucket", STATS_DEFAULT_BUCKET, &bucket) ||
+      !query_u32(q, "pct", 0, &pct))
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad number in query");
+    return ESP_OK;
   }
+  if (pct > 100)
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "pct must be 0..100");
+    return ESP_OK;
+  }
+
+  httpd_resp_set_type(req, "application/json");
 
+  resp_buf_t out;
+  resp_buf_init(&out, req);
+  resp_buf_compress(&out);
+  resp_buf_printf(&out,
+                  "{\"s\":%d,\"bucket\":%" PRIu32 ",\"pct\":%" PRIu32
+                  ",\"rows\":[",
+                  NTC_TEMP_SCALE, bucket, pct);
+
+  stats_ctx_t ctx = {.out = &out, .count = 0, .pct = pct != 0};
+  ntc_history_aggregate(since, until, bucket, (uint8_t) pct, stats_stream_cb,
+                        &ctx);
+
+  resp_buf_puts(&out, "]}");
+  resp_buf_end(&out);
+  return ESP_OK;
+}
+
+static esp_err_t stats_get_handler(httpd_req_t *req)
+{
+  return async_submit(req, stats_run);
+}
+
+/* Handler for /latest.json: the last sweep, straight from RAM */
+static esp_err_t latest_get_handler(httpd_req_t *req)
+{
+  ntc_latest_t l;
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  if (!ntc_history_get_latest(&l))
+  {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, "no sweep yet");
+    return ESP_OK;
+  }
+
+  // {"n":<sweep>,"t":<ts>,"age_ms":<ms>,"s":<scale>,"v":[...],"valid":[...]}
+  char buf[64 + 3 * RECORD_FMT_U32_MAX + RECORD_FMT_I32_MAX +
+           9 * NTC_CHANNELS_COUNT];
+  int64_t age_ms = (esp_timer_get_time() - l.taken_us) / 1000;
+  size_t n = 0;
+
+  memcpy(buf, "{\"n\":", 5);
+  n += 5;
+  n += record_fmt_u32(buf + n, l.sweep);
+  memcpy(buf + n, ",\"t\":", 5);
+  n += 5;
+  n += record_fmt_u32(buf + n, l.timestamp);
+  memcpy(buf + n, ",\"age_ms\":", 10);
+  n += 10;
+  n += record_fmt_u32(buf + n, age_ms > UINT32_MAX ? UINT32_MAX
+                                                   : (uint32_t) age_ms);
+  memcpy(buf + n, ",\"s\":", 5);
+  n += 5;
+  n += record_fmt_i32(buf + n, NTC_TEMP_SCALE);
+  memcpy(buf + n, ",\"v\":[", 6);
+  n += 6;
+  for (int i = 0; i < NTC_CHANNELS_COUNT; i++)
+  {
+    if (i)
+      buf[n++] = ',';
+    if (l.valid_mask & (1u << i))
+      n += record_fmt_i32(buf + n, l.temps_cC[i]);
+    else
+    {
+      memcpy(buf + n, "null", 4);
+      n += 4;
+    }
+  }
+  memcpy(buf + n, "],\"valid\":[", 11);
+  n += 11;
+  for (int i = 0; i < NTC_CHANNELS_COUNT; i++)
+  {
+    if (i)
+      buf[n++] = ',';
+    buf[n++] = (l.valid_mask & (1u << i)) ? '1' : '0';
+  }
+  buf[n++] = ']';
+  buf[n++] = '}';
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send(req, buf, n);
+  return ESP_OK;
+}
+
+/* Handler for /storage.json */
+static int append_hist(char *buf, size_t size, int len, const char *name,
+                       const uint32_t hist[NTC_HISTORY_LAT_BUCKETS])
+{
+  len += snprintf(buf + len, size - len, "\"%s\":[", name);
+  for (int i = 0; i < NTC_HISTORY_LAT_BUCKETS; i++)
+  {
+    len += snprintf(buf + len, size - len, "%s%" PRIu32, i ? "," : "",
+                    hist[i]);
+  }
+  len += snprintf(buf + len, size - len, "]");
+  return len;
+}
+
+static esp_err_t storage_get_handler(httpd_req_t *req)
+{
+  ntc_history_stats_t st;
+  ntc_history_get_stats(&st);
+
+  char buf[896];
+  int len = snprintf(
+      buf, sizeof(buf),
+      "{\"capacity\":%u,\"buffered\":%" PRIu32 ","
+      "\"queue\":{\"size\":%" PRIu32 ",\"depth\":%" PRIu32
+      ",\"max\":%" PRIu32 ",\"dropped\":%" PRIu32 "},"
+      "\"erase\":{\"count\":%" PRIu32 ",\"inline\":%" PRIu32
+      ",\"last_us\":%" PRIu32 ",\"max_us\":%" PRIu32
+      ",\"total_us\":%" PRIu64 "},"
+      "\"crc_failures\":%" PRIu32 ","
+      "\"bytes\":{\"lifetime\":%" PRIu64 ",\"boot\":%" PRIu64 "},"
+      "\"wear\":{\"min\":%" PRIu32 ",\"max\":%" PRIu32
+      ",\"endurance\":%u,\"days_left\":",
+      (unsigned) ntc_history_get_capacity(), st.buffered, st.queue_size,
+      st.queue_depth, st.queue_max, st.dropped, st.erase_count,
+      st.erase_inline, st.erase_last_us, st.erase_max_us, st.erase_total_us,
+      st.crc_failures, st.bytes_written, st.bytes_boot, st.wear_min,
+      st.wear_max, (unsigned) NTC_HISTORY_ENDURANCE_CYCLES);
+
+  // No projection until something has been written this boot
+  if (st.wear_days_left == UINT32_MAX)
+    len += snprintf(buf + len, sizeof(buf) - len, "null},");
+  else
+    len += snprintf(buf + len, sizeof(buf) - len, "%" PRIu32 "},",
+                    st.wear_days_left);
+
+  len += snprintf(buf + len, sizeof(buf) - len,
+                  "\"latency\":{\"base_us\":%u,",
+                  (unsigned) NTC_HISTORY_LAT_BASE_US);
+  len = append_hist(buf, sizeof(buf), len, "write", st.write_hist);
+  len += snprintf(buf + len, sizeof(buf) - len, ",");
+  len = append_hist(buf, sizeof(buf), len, "erase", st.erase_hist);
+
+  // Compressed responses since boot: ratio is in / out, speed in / us
+  len += snprintf(buf + len, sizeof(buf) - len,
+                  "},\"deflate\":{\"streams\":%u,\"in\":%u,\"out\":%u,\"us\":%u}}",
+                  atomic_load(&s_z_streams), atomic_load(&s_z_in),
+                  atomic_load(&s_z_out), atomic_load(&s_z_us));
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send(req, buf, len);
   return ESP_OK;
 }
 
 /* Handler for the scan URL */
-static esp_err_t scan_get_handler(httpd_req_t *req)
+static esp_err_t scan_run(httpd_req_t *req)
 {
   char *json = wifi_app_scan();
   if (json)
@@ -171,6 +1359,11 @@ static esp_err_t scan_get_handler(httpd_req_t *req)
   return ESP_OK;
 }
 
+static esp_err_t scan_get_handler(httpd_req_t *req)
+{
+  return async_submit(req, scan_run);
+}
+
 /* Async Connection Task */
 typedef struct
 {
@@ -256,7 +1449,10 @@ static esp_err_t connect_post_handler(httpd_req_t *req)
 static esp_err_t fake_history_get_handler(httpd_req_t *req)
 {
   httpd_resp_set_type(req, "application/json");
-  httpd_resp_sendstr_chunk(req, "[");
+
+  resp_buf_t out;
+  resp_buf_init(&out, req);
+  resp_buf_puts(&out, "[");
 
   uint32_t now = (uint32_t) time(NULL);
   if (now < 1700000000)
@@ -264,30 +1460,28 @@ static esp_err_t fake_history_get_handler(httpd_req_t *req)
 
   for (int i = 0; i < 100; i++)
   {
-    uint32_t t = now - (100 - i) * 120;
-    char buf[256];
-    int vals[NTC_CHANNELS_COUNT];
+    ntc_record_t rec = {.timestamp = now - (100 - i) * 120};
 
     for (int ch = 0; ch < NTC_CHANNELS_COUNT; ch++)
     {
       float base = 25.0f + ch * 2.0f;
       float amplitude = 5.0f;
-      float val = base + amplitude * sinf((float) (t % 3600) / 3600.0f * 2.0f * M_PI + (ch * 0.5f));
-      vals[ch] = (int) (val * NTC_TEMP_SCALE);
+      float val = base + amplitude * sinf((float) (rec.timestamp % 3600) / 3600.0f * 2.0f * M_PI + (ch * 0.5f));
+      rec.temps_cC[ch] = (int16_t) (val * NTC_TEMP_SCALE);
     }
 
-    int len = snprintf(
-        buf, sizeof(buf),
-        "%s{\"t\":%" PRIu32 ",\"s\":%d,\"v\":[%d,%d,%d,%d,%d,%d,%d,%d,%d,%d]}",
-        (i == 0) ? "" : ",", t, NTC_TEMP_SCALE,
-        vals[0], vals[1], vals[2], vals[3], vals[4],
-        vals[5], vals[6], vals[7], vals[8], vals[9]);
-
-    httpd_resp_send_chunk(req, buf, len);
+    char *p = resp_buf_reserve(&out, 1 + RECORD_FMT_JSON_MAX);
+    if (!p)
+      break;
+    size_t len = 0;
+    if (i > 0)
+      p[len++] = ',';
+    len += record_fmt_json(p + len, &rec, NULL, 0, false);
+    resp_buf_commit(&out, len);
   }
 
-  httpd_resp_sendstr_chunk(req, "]");
-  httpd_resp_send_chunk(req, NULL, 0);
+  resp_buf_puts(&out, "]");
+  resp_buf_end(&out);
 
   return ESP_OK;
 }
@@ -310,18 +1504,54 @@ static const httpd_uri_t index_uri = {
     .handler = index_get_handler,
     .user_ctx = NULL};
 
+static const httpd_uri_t chart_js_uri = {
+    .uri = "/chart.js",
+    .method = HTTP_GET,
+    .handler = chart_js_get_handler,
+    .user_ctx = NULL};
+
 static const httpd_uri_t history_uri = {
     .uri = "/history.json",
     .method = HTTP_GET,
     .handler = history_get_handler,
     .user_ctx = NULL};
 
+static const httpd_uri_t history_bin_uri = {
+    .uri = "/history.bin",
+    .method = HTTP_GET,
+    .handler = history_bin_get_handler,
+    .user_ctx = NULL};
+
+static const httpd_uri_t events_uri = {
+    .uri = "/events",
+    .method = HTTP_GET,
+    .handler = events_get_handler,
+    .user_ctx = NULL};
+
 static const httpd_uri_t fake_history_uri = {
     .uri = "/fake_history.json",
     .method = HTTP_GET,
     .handler = fake_history_get_handler,
     .user_ctx = NULL};
 
+static const httpd_uri_t latest_uri = {
+    .uri = "/latest.json",
+    .method = HTTP_GET,
+    .handler = latest_get_handler,
+    .user_ctx = NULL};
+
+static const httpd_uri_t storage_uri = {
+    .uri = "/storage.json",
+    .method = HTTP_GET,
+    .handler = storage_get_handler,
+    .user_ctx = NULL};
+
+static const httpd_uri_t stats_uri = {
+    .uri = "/stats.json",
+    .method = HTTP_GET,
+    .handler = stats_get_handler,
+    .user_ctx = NULL};
+
 static const httpd_uri_t reset_wifi_uri = {
     .uri = "/reset_wifi",
     .method = HTTP_POST,
@@ -356,15 +1586,43 @@ esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err)
 esp_err_t web_server_start(void)
 {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.max_uri_handlers = 12;
+  config.max_uri_handlers = 14;
   config.stack_size = 8192;   // Increase stack for scan handling
+  // Long requests hold their socket: keep room for the quick ones, and let
+  // idle keep-alive connections be recycled
+  config.max_open_sockets = CONFIG_LWIP_MAX_SOCKETS - 5;   // httpd 3, UDP 2
+  config.lru_purge_enable = true;
+
+  if (!s_async_queue && async_start() != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to start the async workers");
+    return ESP_FAIL;
+  }
+
+  if (!s_sse_queue)
+  {
+    s_sse_queue = xQueueCreate(SSE_QUEUE_LEN, sizeof(sse_msg_t));
+    if (!s_sse_queue ||
+        xTaskCreate(sse_task, "sse_task", SSE_TASK_STACK, NULL, 5, NULL) != pdPASS)
+    {
+      ESP_LOGE(TAG, "Failed to start the event stream task");
+      return ESP_FAIL;
+    }
+    ntc_history_set_live_cb(sse_live_cb, NULL);
+  }
 
   ESP_LOGI(TAG, "Starting web server on port: '%d'", config.server_port);
   if (httpd_start(&server, &config) == ESP_OK)
   {
     httpd_register_uri_handler(server, &index_uri);
+    httpd_register_uri_handler(server, &chart_js_uri);
     httpd_register_uri_handler(server, &history_uri);
+    httpd_register_uri_handler(server, &history_bin_uri);
+    httpd_register_uri_handler(server, &events_uri);
     httpd_register_uri_handler(server, &fake_history_uri);
+    httpd_register_uri_handler(server, &latest_uri);
+    httpd_register_uri_handler(server, &storage_uri);
+    httpd_register_uri_handler(server, &stats_uri);
     httpd_register_uri_handler(server, &reset_wifi_uri);
     httpd_register_uri_handler(server, &scan_uri);
     httpd_register_uri_handler(server, &connect_uri);